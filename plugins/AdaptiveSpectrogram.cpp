@@ -18,12 +18,18 @@
 #include <cstdio>
 #include <cstring>
 #include <cfloat>
+#include <algorithm>
 
 #include <iostream>
 
 #include <dsp/transforms/FFT.h>
 #include <dsp/rateconversion/Decimator.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ADAPTIVE_SPECTROGRAM_SSE2 1
+#include <emmintrin.h>
+#endif
+
 using std::string;
 using std::vector;
 using std::cerr;
@@ -39,29 +45,37 @@ AdaptiveSpectrogram::AdaptiveSpectrogram(float inputSampleRate) :
     m_n(2),
     m_coarse(false),
     m_threaded(true),
+    m_threads(4),
+    m_single(false),
+    m_packed(false),
     m_decFactor(1),
     m_buffer(0),
     m_buflen(0),
     m_decimator(0),
-    m_threadsInUse(false)
+    m_spectrograms(0),
+    m_singleSpectrograms(0),
+    m_pool(0),
+    m_grain(1024),
+    m_allocator(new BlockAllocator(sizeof(Cutting)))
 {
 }
 
 AdaptiveSpectrogram::~AdaptiveSpectrogram()
 {
-    for (int i = 0; i < int(m_cutThreads.size()); ++i) {
-        delete m_cutThreads[i];
-    }
-    m_cutThreads.clear();
-
-    for (FFTMap::iterator i = m_fftThreads.begin();
-         i != m_fftThreads.end(); ++i) {
-        delete i->second;
+    for (int t = 0; t < int(m_ffts.size()); ++t) {
+        for (FFTMap::iterator i = m_ffts[t].begin();
+             i != m_ffts[t].end(); ++i) {
+            delete i->second;
+        }
     }
-    m_fftThreads.clear();
+    m_ffts.clear();
 
+    delete m_pool;
+    delete m_spectrograms;
+    delete m_singleSpectrograms;
     delete[] m_buffer;
     delete m_decimator;
+    delete m_allocator;
 }
 
 string
@@ -135,6 +149,35 @@ AdaptiveSpectrogram::initialise(size_t channels, size_t stepSize, size_t blockSi
     m_buflen = (blockSize * 2) / m_decFactor; // *2 for 50% overlap
     m_buffer = new float[m_buflen];
 
+    int minwid = (2 << m_w), maxwid = ((2 << m_w) << m_n);
+
+    m_columns = vector<float *>(maxwid/minwid);
+
+    delete m_spectrograms;
+    delete m_singleSpectrograms;
+    m_spectrograms = 0;
+    m_singleSpectrograms = 0;
+    if (m_single) {
+        m_singleSpectrograms = new Spectrograms<float>(minwid/2, maxwid/2, 1);
+    } else {
+        m_spectrograms = new Spectrograms<double>(minwid/2, maxwid/2, 1);
+    }
+
+    delete m_pool;
+    m_pool = 0;
+    if (m_threaded && m_threads > 1) {
+        m_pool = new TaskPool(m_threads);
+    }
+
+    for (int t = 0; t < int(m_ffts.size()); ++t) {
+        for (FFTMap::iterator i = m_ffts[t].begin();
+             i != m_ffts[t].end(); ++i) {
+            delete i->second;
+        }
+    }
+    m_ffts.clear();
+    m_ffts.resize(m_pool ? m_pool->getThreadCount() : 1);
+
     reset();
     
     return true;
@@ -230,6 +273,50 @@ AdaptiveSpectrogram::getParameterDescriptors() const
     desc3.quantizeStep = 1;
     list.push_back(desc3);
 
+    desc3.identifier = "precision";
+    desc3.name = "Single precision";
+    desc3.description = "Calculate the spectrograms and select among them using single-precision rather than double-precision arithmetic, which is faster but may choose slightly differently where resolutions are close in cost";
+    desc3.unit = "";
+    desc3.minValue = 0;
+    desc3.maxValue = 1;
+    desc3.defaultValue = 0;
+    desc3.isQuantized = true;
+    desc3.quantizeStep = 1;
+    list.push_back(desc3);
+
+    desc3.identifier = "packed";
+    desc3.name = "Pack columns";
+    desc3.description = "Return all the columns calculated from each processing block in a single feature, one after another, rather than one feature per column";
+    desc3.unit = "";
+    desc3.minValue = 0;
+    desc3.maxValue = 1;
+    desc3.defaultValue = 0;
+    desc3.isQuantized = true;
+    desc3.quantizeStep = 1;
+    list.push_back(desc3);
+
+    desc3.identifier = "threads";
+    desc3.name = "Number of threads";
+    desc3.description = "Number of threads to use for multi-threaded processing";
+    desc3.unit = "";
+    desc3.minValue = 1;
+    desc3.maxValue = 32;
+    desc3.defaultValue = 4;
+    desc3.isQuantized = true;
+    desc3.quantizeStep = 1;
+    list.push_back(desc3);
+
+    desc3.identifier = "grain";
+    desc3.name = "Task size";
+    desc3.description = "Approximate number of samples or cells calculated in each task shared out among the threads in multi-threaded processing.  Smaller tasks balance the load better, larger ones cost less to hand out.  The output does not depend on it";
+    desc3.unit = "";
+    desc3.minValue = 64;
+    desc3.maxValue = 16384;
+    desc3.defaultValue = 1024;
+    desc3.isQuantized = true;
+    desc3.quantizeStep = 64;
+    list.push_back(desc3);
+
     return list;
 }
 
@@ -239,6 +326,10 @@ AdaptiveSpectrogram::getParameter(std::string id) const
     if (id == "n") return m_n+1;
     else if (id == "w") return m_w+1;
     else if (id == "threaded") return (m_threaded ? 1 : 0);
+    else if (id == "threads") return m_threads;
+    else if (id == "grain") return m_grain;
+    else if (id == "precision") return (m_single ? 1 : 0);
+    else if (id == "packed") return (m_packed ? 1 : 0);
     else if (id == "coarse") return (m_coarse ? 1 : 0);
     else if (id == "dec") {
         int f = m_decFactor;
@@ -263,6 +354,16 @@ AdaptiveSpectrogram::setParameter(std::string id, float value)
         if (w >= 1 && w <= 14) m_w = w-1;
     } else if (id == "threaded") {
         m_threaded = (value > 0.5);
+    } else if (id == "threads") {
+        int t = lrintf(value);
+        if (t >= 1 && t <= 32) m_threads = t;
+    } else if (id == "grain") {
+        int g = lrintf(value);
+        if (g >= 64 && g <= 16384) m_grain = g;
+    } else if (id == "precision") {
+        m_single = (value > 0.5);
+    } else if (id == "packed") {
+        m_packed = (value > 0.5);
     } else if (id == "coarse") {
         m_coarse = (value > 0.5);
     } else if (id == "dec") {
@@ -288,6 +389,16 @@ AdaptiveSpectrogram::getOutputDescriptors() const
     d.sampleType = OutputDescriptor::FixedSampleRate;
     d.sampleRate = m_inputSampleRate / (m_decFactor * ((2 << m_w) / 2));
     d.hasDuration = false;
+    if (m_packed) {
+        // one feature per process block, holding maxwid/minwid
+        // columns of maxwid/2 values each
+        int minwid = (2 << m_w), maxwid = ((2 << m_w) << m_n);
+        d.description = "The output of the plugin, with all the columns calculated from each processing block in a single feature";
+        d.binCount = (maxwid/minwid) * (maxwid/2);
+        d.sampleRate = m_inputSampleRate / (m_decFactor * (maxwid / 2));
+        list.push_back(d);
+        return list;
+    }
     char name[20];
     for (int i = 0; i < int(d.binCount); ++i) {
         float freq = (m_inputSampleRate / (m_decFactor * (d.binCount * 2)) * (i + 1)); // no DC bin
@@ -331,7 +442,147 @@ AdaptiveSpectrogram::process(const float *const *inputBuffers, RealTime)
          << minwid/2 << " to " << maxwid/2 << " in real parts)" << endl;
 #endif
 
-    Spectrograms s(minwid/2, maxwid/2, 1);
+    int cutwid = maxwid/2;
+    Cutting *cutting;
+
+    if (m_single) {
+        cutting = analyse(*m_singleSpectrograms, minwid, maxwid);
+    } else {
+        cutting = analyse(*m_spectrograms, minwid, maxwid);
+    }
+
+#ifdef DEBUG_VERBOSE
+    printCutting(cutting, "  ");
+#endif
+
+    // Assemble straight into the values of the features we return,
+    // rather than into a separate matrix to be copied from
+
+    int columns = maxwid/minwid;
+    FeatureList &fl = fs[0];
+
+    if (m_packed) {
+        fl.resize(1);
+        fl[0].hasTimestamp = false;
+        fl[0].values.resize(columns * cutwid);
+        for (int i = 0; i < columns; ++i) {
+            m_columns[i] = &fl[0].values[i * cutwid];
+        }
+    } else {
+        fl.resize(columns);
+        for (int i = 0; i < columns; ++i) {
+            fl[i].hasTimestamp = false;
+            fl[i].values.resize(cutwid);
+            m_columns[i] = &fl[i].values[0];
+        }
+    }
+    
+    assemble(cutting, &m_columns[0], 0, 0, columns, cutwid);
+
+    cutting->erase();
+
+//    std::cerr << "process returning!\n" << std::endl;
+
+    return fs;
+}
+
+// Copy a frame of n samples from the input buffer, applying the window
+static void
+windowFrame(const float *in, const double *window, double *out, int n)
+{
+    int j = 0;
+#ifdef ADAPTIVE_SPECTROGRAM_SSE2
+    for (; j + 2 <= n; j += 2) {
+        __m128 f = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(in + j)));
+        _mm_storeu_pd(out + j, _mm_mul_pd(_mm_cvtps_pd(f),
+                                          _mm_loadu_pd(window + j)));
+    }
+#endif
+    for (; j < n; ++j) {
+        out[j] = in[j] * window[j];
+    }
+}
+
+// Write n scaled magnitudes from the real and imaginary FFT outputs
+static void
+calculateMagnitudes(const double *re, const double *im, double scale,
+                    double *out, int n)
+{
+    int j = 0;
+#ifdef ADAPTIVE_SPECTROGRAM_SSE2
+    const __m128d s = _mm_set1_pd(scale);
+    for (; j + 2 <= n; j += 2) {
+        __m128d r = _mm_loadu_pd(re + j);
+        __m128d i = _mm_loadu_pd(im + j);
+        __m128d m = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(r, r),
+                                           _mm_mul_pd(i, i)));
+        _mm_storeu_pd(out + j, _mm_mul_pd(m, s));
+    }
+#endif
+    for (; j < n; ++j) {
+        out[j] = sqrt(re[j] * re[j] + im[j] * im[j]) * scale;
+    }
+}
+
+static void
+calculateMagnitudes(const double *re, const double *im, double scale,
+                    float *out, int n)
+{
+    int j = 0;
+#ifdef ADAPTIVE_SPECTROGRAM_SSE2
+    const __m128 s = _mm_set1_ps(float(scale));
+    for (; j + 4 <= n; j += 4) {
+        __m128 r = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(re + j)),
+                                 _mm_cvtpd_ps(_mm_loadu_pd(re + j + 2)));
+        __m128 i = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(im + j)),
+                                 _mm_cvtpd_ps(_mm_loadu_pd(im + j + 2)));
+        __m128 m = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(r, r),
+                                          _mm_mul_ps(i, i)));
+        _mm_storeu_ps(out + j, _mm_mul_ps(m, s));
+    }
+#endif
+    for (; j < n; ++j) {
+        float r = float(re[j]), i = float(im[j]);
+        out[j] = sqrtf(r * r + i * i) * float(scale);
+    }
+}
+
+template <typename T>
+void
+AdaptiveSpectrogram::FFTCalculator::calculate(const float *timeDomain,
+                                              Spectrograms<T> &s,
+                                              int res, int maxwidth,
+                                              int from, int to)
+{
+    int origin = maxwidth/4 - m_w/4; // for 50% overlap
+
+    Spectrogram<T> *spectrogram = s.spectrograms[res];
+
+    for (int i = from; i < to; ++i) {
+        windowFrame(timeDomain + origin + i * m_w/2, &m_window[0],
+                    m_rin, m_w);
+        m_fft->forward(m_rin, m_rout, m_iout);
+        // include Nyquist but not DC
+        T *column = spectrogram->column(i);
+        calculateMagnitudes(m_rout + 1, m_iout + 1, m_scale,
+                            column, m_w/2);
+        // and calculate the costs here, while the values are in
+        // cache, rather than at the leaves of the cutting search
+        T *costs = spectrogram->costColumn(i);
+        for (int j = 0; j < m_w/2; ++j) {
+            costs[j] = xlogx(column[j]);
+        }
+    }
+}
+
+template <typename T>
+AdaptiveSpectrogram::Cutting *
+AdaptiveSpectrogram::analyse(Spectrograms<T> &s, int minwid, int maxwid)
+{
+    // Divide each wanted resolution into tasks of roughly m_grain
+    // samples each, and have the pool calculate them all together
+
+    FFTTaskSet<T> ffts(this, m_buffer, s, maxwid);
 
     int w = minwid;
     int index = 0;
@@ -344,64 +595,39 @@ AdaptiveSpectrogram::process(const float *const *inputBuffers, RealTime)
             continue;
         }
 
-        if (m_fftThreads.find(w) == m_fftThreads.end()) {
-            m_fftThreads[w] = new FFTThread(w);
+        for (int t = 0; t < int(m_ffts.size()); ++t) {
+            if (m_ffts[t].find(w) == m_ffts[t].end()) {
+                m_ffts[t][w] = new FFTCalculator(w);
+            }
         }
-        if (m_threaded) {
-            m_fftThreads[w]->startCalculation(m_buffer, s, index, maxwid);
-        } else {
-            m_fftThreads[w]->setParameters(m_buffer, s, index, maxwid);
-            m_fftThreads[w]->performTask();
+
+        int frames = maxwid / w;
+        int step = std::max(1, m_grain / w);
+
+        for (int i = 0; i < frames; i += step) {
+            FFTTask task;
+            task.res = index;
+            task.w = w;
+            task.from = i;
+            task.to = std::min(i + step, frames);
+            ffts.tasks.push_back(task);
         }
+
         w *= 2;
         ++index;
     }
 
-    if (m_threaded) {
-        w = minwid;
-        index = 0;
-        while (w <= maxwid) {
-            if (!isResolutionWanted(s, w/2)) {
-                w *= 2;
-                ++index;
-                continue;
-            }
-            m_fftThreads[w]->await();
-            w *= 2;
-            ++index;
+    if (m_pool) {
+        m_pool->run(&ffts, int(ffts.tasks.size()));
+    } else {
+        for (int i = 0; i < int(ffts.tasks.size()); ++i) {
+            ffts.performTask(i, 0);
         }
     }
 
-    m_threadsInUse = false;
-
 //    std::cerr << "maxwid/2 = " << maxwid/2 << ", minwid/2 = " << minwid/2 << ", n+1 = " << m_n+1 << ", 2^(n+1) = " << (2<<m_n) << std::endl;
 
-    int cutwid = maxwid/2;
-    Cutting *cutting = cut(s, cutwid, 0, 0, cutwid, 0);
-
-#ifdef DEBUG_VERBOSE
-    printCutting(cutting, "  ");
-#endif
-
-    vector<vector<float> > rmat(maxwid/minwid);
-    for (int i = 0; i < maxwid/minwid; ++i) {
-        rmat[i] = vector<float>(maxwid/2);
-    }
-    
-    assemble(s, cutting, rmat, 0, 0, maxwid/minwid, cutwid);
-
-    cutting->erase();
-
-    for (int i = 0; i < int(rmat.size()); ++i) {
-        Feature f;
-        f.hasTimestamp = false;
-        f.values = rmat[i];
-        fs[0].push_back(f);
-    }
-
-//    std::cerr << "process returning!\n" << std::endl;
-
-    return fs;
+    return cut(s, maxwid/2);
 }
 
 void
@@ -420,166 +646,238 @@ AdaptiveSpectrogram::printCutting(Cutting *c, string pfx) const
     }
 }
 
+template <typename T>
+AdaptiveSpectrogram::Cutting *
+AdaptiveSpectrogram::cut(Spectrograms<T> &s, int maxres)
+{
+    // Each cell (res, x, y, h) may be reached by many different
+    // sequences of cuts, but its best cutting depends only on the
+    // cell itself.  So rather than search the tree of cuttings
+    // recursively, we calculate the best cost and energy for every
+    // cell, working up from the smallest (h = 1) to the whole
+    // spectrogram, and then build only the winning cutting.
+    //
+    // A cell at depth d has height h = maxres >> d; after k of those
+    // d cuts have been left/right splits, it is at resolution res =
+    // maxres >> k.  There are 2^k columns at that resolution and
+    // res/h = 2^(d-k) rows of height h, so 2^d cells for each (d, k).
+
+    int nres = s.n;
+    int depth = 0;
+    while ((maxres >> depth) > 1) ++depth;
+
+    m_cellOffsets.resize((depth + 1) * nres);
+    int cells = 0;
+    for (int d = 0; d <= depth; ++d) {
+        for (int k = 0; k <= d && k < nres; ++k) {
+            m_cellOffsets[d * nres + k] = cells;
+            cells += (1 << d);
+        }
+    }
+    s.costs.resize(cells);
+    s.values.resize(cells);
+    m_cellCuts.resize(cells);
+
+    // The cells at each depth depend only on those at the next, so
+    // each depth may be divided among the threads of the pool
+
+    for (int d = depth; d >= 0; --d) {
+
+        int count = (std::min(d, nres - 1) + 1) << d;
+
+        if (m_pool && count > m_grain) {
+            CutTaskSet<T> tasks(this, s, maxres, d, count);
+            m_pool->run(&tasks, (count + m_grain - 1) / m_grain);
+        } else {
+            calculateCells(s, maxres, d, 0, count);
+        }
+    }
+
+    return buildCutting(s, 0, 0, 0, 0);
+}
+
+template <typename T>
 void
-AdaptiveSpectrogram::getSubCuts(const Spectrograms &s,
-                                int res,
-                                int x, int y, int h,
-                                Cutting **top, Cutting **bottom,
-                                Cutting **left, Cutting **right,
-                                BlockAllocator *allocator) const
+AdaptiveSpectrogram::calculateCells(Spectrograms<T> &s, int maxres,
+                                    int d, int from, int to)
 {
-    if (m_threaded && !m_threadsInUse) {
+    // Calculate cells [from, to) of those at depth d, in the order in
+    // which they are stored: by k, then x, then y
+
+    int nres = s.n;
+    int h = maxres >> d;
+    int perk = 1 << d;
+
+    for (int k = from / perk; k * perk < to; ++k) {
 
-        m_threadsInUse = true;
+        int res = maxres >> k;
+        int rows = 1 << (d - k);
+        int base = m_cellOffsets[d * nres + k];
+        int first = std::max(from - k * perk, 0);
+        int last = std::min(to - k * perk, perk);
 
-        if (m_cutThreads.empty()) {
-            for (int i = 0; i < 4; ++i) {
-                CutThread *t = new CutThread(this);
-                m_cutThreads.push_back(t);
+        if (h == 1 || res == s.minres) {
+
+            // no cuts possible from this level
+
+            const Spectrogram<T> *spectrogram = s.spectrograms[nres - 1 - k];
+
+            for (int j = first; j < last; ++j) {
+                int x = j / rows;
+                int y = (j % rows) * h;
+                s.costs[base + j] = cost(*spectrogram, x, y);
+                s.values[base + j] = value(*spectrogram, x, y);
+                m_cellCuts[base + j] = Cutting::Finished;
             }
+
+            continue;
         }
 
-        // Cut threads 0 and 1 calculate the top and bottom halves;
-        // threads 2 and 3 calculate left and right.  See notes in
-        // unthreaded code below for more information.
+        // The "vertical" division is a top/bottom split.  Splitting
+        // this way keeps us in the same resolution, but with two
+        // vertical subregions of height h/2.
 
-        if (top) m_cutThreads[0]->cut(s, res, x, y + h/2, h/2);
-        if (bottom) m_cutThreads[1]->cut(s, res, x, y, h/2);
+        // The "horizontal" division is a left/right split.
+        // Splitting this way places us in resolution res/2, which has
+        // lower vertical resolution but higher horizontal resolution,
+        // so the cells below are in twice as many columns but the
+        // same number of rows.
 
-        if (left) m_cutThreads[2]->cut(s, res/2, 2 * x, y/2, h/2);
-        if (right) m_cutThreads[3]->cut(s, res/2, 2 * x + 1, y/2, h/2);
+        bool vertical = isResolutionWanted(s, res);
+        bool horizontal = !(vertical && h == 2 &&
+                            !isResolutionWanted(s, res/2));
 
-        if (top) *top = m_cutThreads[0]->get();
-        if (bottom) *bottom = m_cutThreads[1]->get();
-        if (left) *left = m_cutThreads[2]->get();
-        if (right) *right = m_cutThreads[3]->get();
+        int vbase = m_cellOffsets[(d + 1) * nres + k];
+        int hbase = m_cellOffsets[(d + 1) * nres + k + 1];
 
-    } else {
+        for (int j = first; j < last; ++j) {
 
-        // Unthreaded version
+            int x = j / rows;
+            int i = j % rows;
 
-        // The "vertical" division is a top/bottom split.
-        // Splitting this way keeps us in the same resolution,
-        // but with two vertical subregions of height h/2.
+            int bottom = vbase + x * rows * 2 + i * 2;
+            int top = bottom + 1;
+            int left = hbase + x * rows * 2 + i;
+            int right = left + rows;
 
-        if (top) *top = cut(s, res, x, y + h/2, h/2, allocator);
-        if (bottom) *bottom = cut(s, res, x, y, h/2, allocator);
+            T vcost = 0, venergy = 0;
+            T hcost = 0, henergy = 0;
 
-        // The "horizontal" division is a left/right split.  Splitting
-        // this way places us in resolution res/2, which has lower
-        // vertical resolution but higher horizontal resolution.  We
-        // need to double x accordingly.
-        
-        if (left) *left = cut(s, res/2, 2 * x, y/2, h/2, allocator);
-        if (right) *right = cut(s, res/2, 2 * x + 1, y/2, h/2, allocator);
+            if (vertical) {
+                vcost = s.costs[top] + s.costs[bottom];
+                venergy = s.values[top] + s.values[bottom];
+                vcost = normalize(vcost, venergy);
+            }
+
+            if (horizontal) {
+                hcost = s.costs[left] + s.costs[right];
+                henergy = s.values[left] + s.values[right];
+                hcost = normalize(hcost, henergy);
+            }
+
+            if (horizontal && (!vertical || vcost > hcost)) {
+                s.costs[base + j] = hcost;
+                s.values[base + j] = henergy;
+                m_cellCuts[base + j] = Cutting::Horizontal;
+            } else {
+                s.costs[base + j] = vcost;
+                s.values[base + j] = venergy;
+                m_cellCuts[base + j] = Cutting::Vertical;
+            }
+        }
     }
 }
 
-AdaptiveSpectrogram::Cutting *
-AdaptiveSpectrogram::cut(const Spectrograms &s,
-                         int res,
-                         int x, int y, int h,
-                         BlockAllocator *allocator) const
+AdaptiveSpectrogram::TaskPool::TaskPool(int threads) :
+    m_set(0),
+    m_next(0),
+    m_count(0)
 {
-//    cerr << "res = " << res << ", x = " << x << ", y = " << y << ", h = " << h << endl;
+    for (int i = 1; i < threads; ++i) {
+        m_workers.push_back(new Worker(this, i));
+    }
+}
 
-    Cutting *cutting;
-    if (allocator) {
-        cutting = (Cutting *)(allocator->allocate());
-        cutting->allocator = allocator;
-    } else {
-        cutting = new Cutting;
-        cutting->allocator = 0;
-    }
-
-    if (h > 1 && res > s.minres) {
-
-        if (!isResolutionWanted(s, res)) {
-
-            Cutting *left = 0, *right = 0;
-            getSubCuts(s, res, x, y, h, 0, 0, &left, &right, allocator);
-                
-            double hcost = left->cost + right->cost;
-            double henergy = left->value + right->value;
-            hcost = normalize(hcost, henergy);
-                
-            cutting->cut = Cutting::Horizontal;
-            cutting->first = left;
-            cutting->second = right;
-            cutting->cost = hcost;
-            cutting->value = left->value + right->value;
-
-        } else if (h == 2 && !isResolutionWanted(s, res/2)) {
-
-            Cutting *top = 0, *bottom = 0;
-            getSubCuts(s, res, x, y, h, &top, &bottom, 0, 0, allocator);
-                
-            double vcost = top->cost + bottom->cost;
-            double venergy = top->value + bottom->value;
-            vcost = normalize(vcost, venergy);
-                
-            cutting->cut = Cutting::Vertical;
-            cutting->first = top;
-            cutting->second = bottom;
-            cutting->cost = vcost;
-            cutting->value = top->value + bottom->value;
+AdaptiveSpectrogram::TaskPool::~TaskPool()
+{
+    for (int i = 0; i < int(m_workers.size()); ++i) {
+        delete m_workers[i];
+    }
+}
 
-        } else {
+void
+AdaptiveSpectrogram::TaskPool::run(TaskSet *set, int count)
+{
+    m_set = set;
+    m_next = 0;
+    m_count = count;
 
-            Cutting *top = 0, *bottom = 0, *left = 0, *right = 0;
-            getSubCuts(s, res, x, y, h, &top, &bottom, &left, &right, allocator);
+    int started = std::min(int(m_workers.size()), count - 1);
 
-            double vcost = top->cost + bottom->cost;
-            double venergy = top->value + bottom->value;
-            vcost = normalize(vcost, venergy);
-            
-            double hcost = left->cost + right->cost;
-            double henergy = left->value + right->value;
-            hcost = normalize(hcost, henergy);
-            
-            if (vcost > hcost) {
-                cutting->cut = Cutting::Horizontal;
-                cutting->first = left;
-                cutting->second = right;
-                cutting->cost = hcost;
-                cutting->value = left->value + right->value;
-                top->erase();
-                bottom->erase();
-                return cutting;
-            } else {
-                cutting->cut = Cutting::Vertical;
-                cutting->first = top;
-                cutting->second = bottom;
-                cutting->cost = vcost;
-                cutting->value = top->value + bottom->value;
-                left->erase();
-                right->erase();
-                return cutting;
-            }
-        }
+    for (int i = 0; i < started; ++i) {
+        m_workers[i]->start();
+    }
 
-    } else {
+    work(0);
+
+    for (int i = 0; i < started; ++i) {
+        m_workers[i]->await();
+    }
+}
 
-        // no cuts possible from this level
+void
+AdaptiveSpectrogram::TaskPool::work(int worker)
+{
+    while (true) {
+        int task;
+        m_mutex.lock();
+        task = m_next;
+        if (task < m_count) ++m_next;
+        m_mutex.unlock();
+        if (task >= m_count) break;
+        m_set->performTask(task, worker);
+    }
+}
 
-        cutting->cut = Cutting::Finished;
+template <typename T>
+AdaptiveSpectrogram::Cutting *
+AdaptiveSpectrogram::buildCutting(const Spectrograms<T> &s,
+                                  int d, int k, int x, int i)
+{
+    int nres = s.n;
+    int rows = 1 << (d - k);
+    int c = m_cellOffsets[d * nres + k] + x * rows + i;
+
+    Cutting *cutting = (Cutting *)(m_allocator->allocate());
+    cutting->allocator = m_allocator;
+    cutting->cut = Cutting::Cut(m_cellCuts[c]);
+    cutting->cost = s.costs[c];
+    cutting->value = s.values[c];
+
+    switch (cutting->cut) {
+
+    case Cutting::Finished:
         cutting->first = 0;
         cutting->second = 0;
+        break;
 
-        int n = 0;
-        for (int r = res; r > s.minres; r >>= 1) ++n;
-        const Spectrogram *spectrogram = s.spectrograms[n];
-        cutting->cost = cost(*spectrogram, x, y);
-        cutting->value = value(*spectrogram, x, y);
+    case Cutting::Horizontal:
+        cutting->first = buildCutting(s, d + 1, k + 1, x * 2, i);
+        cutting->second = buildCutting(s, d + 1, k + 1, x * 2 + 1, i);
+        break;
+
+    case Cutting::Vertical:
+        cutting->first = buildCutting(s, d + 1, k, x, i * 2 + 1);
+        cutting->second = buildCutting(s, d + 1, k, x, i * 2);
+        break;
     }
 
     return cutting;
 }
 
 void
-AdaptiveSpectrogram::assemble(const Spectrograms &s,
-                              const Cutting *cutting,
-                              vector<vector<float> > &rmat,
+AdaptiveSpectrogram::assemble(const Cutting *cutting,
+                              float **columns,
                               int x, int y, int w, int h) const
 {
     switch (cutting->cut) {
@@ -587,19 +885,19 @@ AdaptiveSpectrogram::assemble(const Spectrograms &s,
     case Cutting::Finished:
         for (int i = 0; i < w; ++i) {
             for (int j = 0; j < h; ++j) {
-                rmat[x+i][y+j] = cutting->value;
+                columns[x+i][y+j] = cutting->value;
             }
         }
         return;
 
     case Cutting::Horizontal:
-        assemble(s, cutting->first, rmat, x, y, w/2, h);
-        assemble(s, cutting->second, rmat, x+w/2, y, w/2, h);
+        assemble(cutting->first, columns, x, y, w/2, h);
+        assemble(cutting->second, columns, x+w/2, y, w/2, h);
         break;
         
     case Cutting::Vertical:
-        assemble(s, cutting->first, rmat, x, y+h/2, w, h/2);
-        assemble(s, cutting->second, rmat, x, y, w, h/2);
+        assemble(cutting->first, columns, x, y+h/2, w, h/2);
+        assemble(cutting->second, columns, x, y, w, h/2);
         break;
     }        
 }
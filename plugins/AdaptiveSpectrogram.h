@@ -18,6 +18,7 @@
 #include <vamp-sdk/Plugin.h>
 #include <cmath>
 #include <vector>
+#include <stdint.h>
 
 #include <dsp/transforms/FFT.h>
 #include <base/Window.h>
@@ -65,43 +66,73 @@ protected:
     int m_n;
     bool m_coarse;
     bool m_threaded;
+    int m_threads;
+    bool m_single;
+    bool m_packed;
     int m_decFactor;
     float *m_buffer;
     int m_buflen;
     Decimator *m_decimator;
 
+    // Start of each output column within the features being returned
+    std::vector<float *> m_columns;
+
+    // The values for each column x (of resolution values each) are
+    // stored contiguously from data + x * resolution, in a single
+    // buffer aligned to a 64-byte boundary.  The cost (x log x) of
+    // each value is stored in the same layout from costs, which
+    // follows data in the same buffer.  T is double, or float in
+    // single-precision mode.
+    template <typename T>
     struct Spectrogram
     {
         int resolution;
         int width;
-        double **data;
+        T *data;
+        T *costs;
 
         Spectrogram(int r, int w) :
             resolution(r), width(w) {
-            data = new double *[width];
-            for (int i = 0; i < width; ++i) data[i] = new double[resolution];
+            block = new T[2 * width * resolution + 64 / sizeof(T) - 1];
+            data = (T *)(((uintptr_t)block + 63) & ~(uintptr_t)63);
+            costs = data + width * resolution;
+            for (int i = 0; i < 2 * width * resolution; ++i) data[i] = 0;
         }
 
         ~Spectrogram() {
-            for (int i = 0; i < width; ++i) delete[] data[i];
-            delete[] data;
-        }            
+            delete[] block;
+        }
+
+        T *column(int x) { return data + x * resolution; }
+        const T *column(int x) const { return data + x * resolution; }
+
+        T *costColumn(int x) { return costs + x * resolution; }
+        const T *costColumn(int x) const { return costs + x * resolution; }
+
+    private:
+        T *block;
     };
 
+    template <typename T>
     struct Spectrograms
     {
         int minres;
         int maxres;
         int n;
-        Spectrogram **spectrograms;
+        Spectrogram<T> **spectrograms;
+
+        // Best cost and energy for each cell of the cutting search,
+        // indexed as described at m_cellCuts below
+        std::vector<T> costs;
+        std::vector<T> values;
 
         Spectrograms(int mn, int mx, int widthofmax) :
             minres(mn), maxres(mx) {
             n = log2(maxres/minres) + 1;
-            spectrograms = new Spectrogram *[n];
+            spectrograms = new Spectrogram<T> *[n];
             int r = mn;
             for (int i = 0; i < n; ++i) {
-                spectrograms[i] = new Spectrogram(r, widthofmax * (mx / r));
+                spectrograms[i] = new Spectrogram<T>(r, widthofmax * (mx / r));
                 r = r * 2;
             }
         }
@@ -113,6 +144,11 @@ protected:
         }
     };
 
+    // Spectrograms at each resolution, reused for every process
+    // call.  Only one of these exists, depending on the precision.
+    Spectrograms<double> *m_spectrograms;
+    Spectrograms<float> *m_singleSpectrograms;
+
     struct Cutting
     {
         enum Cut { Horizontal, Vertical, Finished };
@@ -139,18 +175,19 @@ protected:
         }
     };
 
-    class FFTThread : public AsynchronousTask
+    class FFTCalculator
     {
     public:
-        FFTThread(int w) :
-            m_window(HanningWindow, w) {
+        FFTCalculator(int w) {
             m_w = w;
+            m_window = Window<double>(HanningWindow, m_w).getWindowData();
+            m_scale = 1.0 / (m_w/2); // exact, as m_w is a power of two
             m_fft = new FFTReal(m_w);
             m_rin = new double[m_w];
             m_rout = new double[m_w];
             m_iout = new double[m_w];
         }
-        ~FFTThread() {
+        ~FFTCalculator() {
             delete[] m_rin;
             delete[] m_rout;
             delete[] m_iout;
@@ -159,119 +196,178 @@ protected:
 
         int getW() const { return m_w; }
 
-        void startCalculation(const float *timeDomain, Spectrograms &s,
-                              int res, int maxwidth) {
-            setParameters(timeDomain, s, res, maxwidth);
-            startTask();
-        }
-
-        void await() {
-            awaitTask();
-        }
-
-        void setParameters(const float *timeDomain, Spectrograms &s,
-                           int res, int maxwidth) {
-            m_in = timeDomain;
-            m_s = &s;
-            m_res = res;
-            m_maxwid = maxwidth;
-        }
-
-        void performTask() {
-            for (int i = 0; i < m_maxwid / m_w; ++i) {
-                int origin = m_maxwid/4 - m_w/4; // for 50% overlap
-                for (int j = 0; j < m_w; ++j) {
-                    m_rin[j] = m_in[origin + i * m_w/2 + j];
-                }
-                m_window.cut(m_rin);
-                m_fft->forward(m_rin, m_rout, m_iout);
-                for (int j = 0; j < m_w/2; ++j) {
-                    int k = j+1; // include Nyquist but not DC
-                    double mag = sqrt(m_rout[k] * m_rout[k] +
-                                      m_iout[k] * m_iout[k]);
-                    double scaled = mag / (m_w/2);
-                    m_s->spectrograms[m_res]->data[i][j] = scaled;
-                }
-            }
-        }
+        // Calculate frames [from, to) of the spectrogram at index res.
+        // Note that successive process calls tile the frame grid
+        // exactly (the buffer advances by maxwidth/2, which is a
+        // whole number of hops of m_w/2 at every resolution), so no
+        // frame is ever calculated twice and there is nothing to
+        // carry over from one call to the next.
+        template <typename T>
+        void calculate(const float *timeDomain, Spectrograms<T> &s,
+                       int res, int maxwidth, int from, int to);
 
     private:
-        Window<double> m_window;
+        std::vector<double> m_window;
+        double m_scale;
         FFTReal *m_fft;
-        const float *m_in;
         double *m_rin;
         double *m_rout;
         double *m_iout;
-        Spectrograms *m_s;
-        int m_res;
         int m_w;
-        int m_maxwid;
     };
 
-    typedef std::map<int, FFTThread *> FFTMap;
-    FFTMap m_fftThreads;
+    // One FFTCalculator for each FFT size, for each thread of the
+    // task pool (or just one thread if not threaded)
+    typedef std::map<int, FFTCalculator *> FFTMap;
+    std::vector<FFTMap> m_ffts;
 
-    class CutThread : public AsynchronousTask
+    // A set of independent tasks, numbered from 0, to be run on a
+    // TaskPool.  The worker index identifies the thread a task is
+    // running on, for tasks that need per-thread workspace.
+    class TaskSet
     {
     public:
-        CutThread(const AdaptiveSpectrogram *as) : m_as(as), m_result(0) {
-            m_allocator = new BlockAllocator(sizeof(Cutting));
-        }
-        ~CutThread() {
-            delete m_allocator;
-        }
-        
-        void cut(const Spectrograms &s, int res, int x, int y, int h) {
-            m_s = &s;
-            m_res = res;
-            m_x = x;
-            m_y = y;
-            m_h = h;
-            startTask();
-        }
+        virtual ~TaskSet() { }
+        virtual void performTask(int task, int worker) = 0;
+    };
 
-        Cutting *get() {
-            awaitTask();
-            return m_result;
-        }
+    // A fixed set of worker threads.  The tasks in a set are handed
+    // out one at a time to whichever thread is free next, including
+    // the calling thread (worker 0), so unevenly sized tasks are
+    // still spread across all threads.
+    class TaskPool
+    {
+    public:
+        TaskPool(int threads);
+        ~TaskPool();
 
-    protected:
-        void performTask() {
-            m_result = m_as->cut(*m_s, m_res, m_x, m_y, m_h, m_allocator);
+        int getThreadCount() const { return int(m_workers.size()) + 1; }
+
+        // Run tasks [0, count) of the given set and wait for them all
+        void run(TaskSet *set, int count);
+
+    private:
+        class Worker : public AsynchronousTask
+        {
+        public:
+            Worker(TaskPool *pool, int index) :
+                m_pool(pool), m_index(index) { }
+
+            void start() { startTask(); }
+            void await() { awaitTask(); }
+
+        protected:
+            void performTask() { m_pool->work(m_index); }
+
+        private:
+            TaskPool *m_pool;
+            int m_index;
+        };
+
+        void work(int worker);
+
+        std::vector<Worker *> m_workers;
+        Mutex m_mutex;
+        TaskSet *m_set;
+        int m_next;
+        int m_count;
+    };
+
+    TaskPool *m_pool;
+
+    // Approximate number of samples (for FFTs) or cells (for the
+    // cutting) to be calculated in each task given to the pool (the
+    // "grain" parameter)
+    int m_grain;
+
+    struct FFTTask
+    {
+        int res;
+        int w;
+        int from;
+        int to;
+    };
+
+    template <typename T>
+    class FFTTaskSet : public TaskSet
+    {
+    public:
+        FFTTaskSet(AdaptiveSpectrogram *as, const float *timeDomain,
+                   Spectrograms<T> &s, int maxwidth) :
+            m_as(as), m_in(timeDomain), m_s(s), m_maxwid(maxwidth) { }
+
+        std::vector<FFTTask> tasks;
+
+        void performTask(int task, int worker) {
+            const FFTTask &t = tasks[task];
+            m_as->m_ffts[worker][t.w]->calculate(m_in, m_s, t.res, m_maxwid,
+                                                 t.from, t.to);
         }
 
     private:
-        const AdaptiveSpectrogram *m_as;
-        BlockAllocator *m_allocator;
-        const Spectrograms *m_s;
-        int m_res;
-        int m_x;
-        int m_y;
-        int m_h;
-        Cutting *m_result;
+        AdaptiveSpectrogram *m_as;
+        const float *m_in;
+        Spectrograms<T> &m_s;
+        int m_maxwid;
     };
 
-    mutable std::vector<CutThread *> m_cutThreads;
-    mutable bool m_threadsInUse;
+    template <typename T>
+    class CutTaskSet : public TaskSet
+    {
+    public:
+        CutTaskSet(AdaptiveSpectrogram *as, Spectrograms<T> &s,
+                   int maxres, int d, int cells) :
+            m_as(as), m_s(s), m_maxres(maxres), m_d(d), m_cells(cells) { }
+
+        void performTask(int task, int) {
+            int from = task * m_as->m_grain;
+            int to = from + m_as->m_grain;
+            if (to > m_cells) to = m_cells;
+            m_as->calculateCells(m_s, m_maxres, m_d, from, to);
+        }
+
+    private:
+        AdaptiveSpectrogram *m_as;
+        Spectrograms<T> &m_s;
+        int m_maxres;
+        int m_d;
+        int m_cells;
+    };
 
-    inline double xlogx(double x) const {
-        if (x == 0.0) return 0.0;
-        else return x * log(x);
+    // Best cut for each cell (res, x, y, h) of the search, filled in
+    // bottom-up by cut() along with the costs and values in the
+    // Spectrograms object.  The cells at depth d (where h = maxres
+    // >> d) below k left/right splits (so that res = maxres >> k)
+    // start at m_cellOffsets[d * s.n + k] and are indexed by x *
+    // 2^(d-k) + y/h.  These are retained between calls, as they are
+    // always the same size for a given setup.
+    std::vector<char> m_cellCuts;
+    std::vector<int> m_cellOffsets;
+    BlockAllocator *m_allocator;
+
+    template <typename T>
+    static inline T xlogx(T x) {
+        if (x == T(0)) return T(0);
+        else return x * std::log(x);
     }
 
-    inline double cost(const Spectrogram &s, int x, int y) const {
-        return xlogx(s.data[x][y]);
+    template <typename T>
+    inline T cost(const Spectrogram<T> &s, int x, int y) const {
+        return s.costColumn(x)[y];
     }
 
-    inline double value(const Spectrogram &s, int x, int y) const {
-        return s.data[x][y];
+    template <typename T>
+    inline T value(const Spectrogram<T> &s, int x, int y) const {
+        return s.column(x)[y];
     }
 
-    inline double normalize(double vcost, double venergy) const {
-        return (vcost + (venergy * log(venergy))) / venergy;
+    template <typename T>
+    inline T normalize(T vcost, T venergy) const {
+        return (vcost + (venergy * std::log(venergy))) / venergy;
     }
 
-    inline bool isResolutionWanted(const Spectrograms &s, int res) const {
+    template <typename T>
+    inline bool isResolutionWanted(const Spectrograms<T> &s, int res) const {
         if (!m_coarse) return true;
         if (res == s.minres || res == s.maxres) return true;
         int n = 0;
@@ -279,18 +375,22 @@ protected:
         return ((n & 0x1) == 0);
     }
 
-    Cutting *cut(const Spectrograms &, int res, int x, int y, int h,
-                 BlockAllocator *allocator) const;
+    template <typename T>
+    Cutting *analyse(Spectrograms<T> &, int minwid, int maxwid);
+
+    template <typename T>
+    Cutting *cut(Spectrograms<T> &, int maxres);
+
+    template <typename T>
+    void calculateCells(Spectrograms<T> &, int maxres, int d,
+                        int from, int to);
 
-    void getSubCuts(const Spectrograms &, int res, int x, int y, int h,
-                    Cutting **top, Cutting **bottom,
-                    Cutting **left, Cutting **right,
-                    BlockAllocator *allocator) const;
+    template <typename T>
+    Cutting *buildCutting(const Spectrograms<T> &, int d, int k, int x, int y);
 
     void printCutting(Cutting *, std::string) const;
 
-    void assemble(const Spectrograms &, const Cutting *,
-                  std::vector<std::vector<float> > &,
+    void assemble(const Cutting *, float **columns,
                   int x, int y, int w, int h) const;
 };
 
@@ -13,13 +13,23 @@
 */
 
 #include "BarBeatTrack.h"
+#include "SharedDetectionFunction.h"
 
 #include <dsp/onsets/DetectionFunction.h>
 #include <dsp/onsets/PeakPicking.h>
 #include <dsp/tempotracking/TempoTrackV2.h>
 #include <dsp/tempotracking/DownBeat.h>
+#include <dsp/rateconversion/Decimator.h>
+#include <dsp/transforms/FFT.h>
+#include <base/Window.h>
 #include <maths/MathUtilities.h>
 
+#include <thread/Thread.h>
+#include <thread/AsynchronousTask.h>
+
+#include <algorithm>
+#include <cmath>
+
 using std::string;
 using std::vector;
 using std::cerr;
@@ -27,35 +37,228 @@ using std::endl;
 
 float BarBeatTracker::m_stepSecs = 0.01161; // 512 samples at 44100
 
+// The decimated audio is stored in blocks of this many samples, so
+// that it never has to be reallocated and copied as it grows.  This
+// does not bound its size, which still grows with the length of the
+// input: the beats are only known at the end, and the spectrum of
+// each beat needs its audio, so all of it has to be kept until then.
+static const int AudioBlockSize = 65536;
+
+// Beat spectral differences are calculated in chunks of this many
+// beats, which are shared out among the threads
+static const int SDChunkBeats = 128;
+
 class BarBeatTrackerData
 {
 public:
     BarBeatTrackerData(float rate, const DFConfig &config) : dfConfig(config) {
-    df = new DetectionFunction(config);
+    df = new SharedDetectionFunction(config);
         // decimation factor aims at resampling to c. 3KHz; must be power of 2
-        int factor = MathUtilities::nextPowerOfTwo(rate / 3000);
+        factor = MathUtilities::nextPowerOfTwo(rate / 3000);
 //        std::cerr << "BarBeatTrackerData: factor = " << factor << std::endl;
-        downBeat = new DownBeat(rate, factor, config.stepSize);
+        makeDecimators();
+        audioLength = 0;
+        int fl = config.frameLength;
+        window = Window<double>(HanningWindow, fl).getWindowData();
+        fft = new FFTReal(fl);
+        frame = new double[fl];
+        reals = new double[fl];
+        imags = new double[fl];
     }
     ~BarBeatTrackerData() {
     delete df;
-        delete downBeat;
+        clearAudio();
+        delete decimator1;
+        delete decimator2;
+        delete[] decbuf;
+        delete[] decout;
+        delete fft;
+        delete[] frame;
+        delete[] reals;
+        delete[] imags;
+    }
+    void transform(const float *block) {
+        // Window the block and rotate it by half its length, then
+        // FFT it, exactly as DetectionFunction::processTimeDomain
+        // would (so the detection function is unchanged)
+        int fl = dfConfig.frameLength;
+        int hs = fl / 2;
+        for (int i = 0; i < fl; ++i) {
+            int j = (i < hs ? i + hs : i - hs);
+            frame[i] = block[j] * window[j];
+        }
+        fft->forward(frame, reals, imags);
+    }
+    void makeDecimators() {
+        // As DownBeat, which we can't use for this because it keeps
+        // its decimated audio in a single buffer that it reallocates
+        // as it grows
+        decimator1 = 0;
+        decimator2 = 0;
+        decbuf = 0;
+        int increment = dfConfig.stepSize;
+        if (factor >= 2) {
+            int highest = Decimator::getHighestSupportedFactor();
+            if (factor <= highest) {
+                decimator1 = new Decimator(increment, factor);
+            } else {
+                decimator1 = new Decimator(increment, highest);
+                decimator2 = new Decimator(increment / highest, factor / highest);
+                decbuf = new float[increment / highest];
+            }
+        }
+        decout = new float[increment / factor];
+    }
+    void pushAudioBlock(const float *audio) {
+        int increment = dfConfig.stepSize;
+        int n = increment / factor;
+        if (decimator2) {
+            decimator1->process(audio, decbuf);
+            decimator2->process(decbuf, decout);
+        } else if (decimator1) {
+            decimator1->process(audio, decout);
+        } else {
+            for (int i = 0; i < n; ++i) decout[i] = audio[i];
+        }
+        for (int i = 0; i < n; ++i) {
+            size_t block = audioLength / AudioBlockSize;
+            if (block == audioBlocks.size()) {
+                audioBlocks.push_back(new float[AudioBlockSize]);
+            }
+            audioBlocks[block][audioLength % AudioBlockSize] = decout[i];
+            ++audioLength;
+        }
+    }
+    void getAudio(size_t from, size_t to, float *dest) const {
+        for (size_t i = from; i < to; ++i) {
+            *dest++ = audioBlocks[i / AudioBlockSize][i % AudioBlockSize];
+        }
+    }
+    void clearAudio() {
+        for (size_t i = 0; i < audioBlocks.size(); ++i) {
+            delete[] audioBlocks[i];
+        }
+        audioBlocks.clear();
+        audioLength = 0;
     }
     void reset() {
     delete df;
-    df = new DetectionFunction(dfConfig);
+    df = new SharedDetectionFunction(dfConfig);
     dfOutput.clear();
-        downBeat->resetAudioBuffer();
+        clearAudio();
+        if (decimator1) decimator1->resetFilter();
+        if (decimator2) decimator2->resetFilter();
         origin = Vamp::RealTime::zeroTime;
     }
 
     DFConfig dfConfig;
-    DetectionFunction *df;
-    DownBeat *downBeat;
+    SharedDetectionFunction *df;
     vector<double> dfOutput;
     Vamp::RealTime origin;
+
+    int factor;
+    Decimator *decimator1;
+    Decimator *decimator2;
+    float *decbuf;
+    float *decout;
+    vector<float *> audioBlocks;
+    size_t audioLength;
+
+    vector<double> window;
+    FFTReal *fft;
+    double *frame;
+    double *reals;
+    double *imags;
 };
 
+// Calculates the beat spectral differences for chunks of beats, taking
+// the next chunk from a shared counter until none remain.  Chunk c
+// covers the differences between beat segments j-1 and j (segment j
+// running from beat j to beat j+1) for j from 1 + c * SDChunkBeats
+// up to the next chunk, and is calculated by running a DownBeat of
+// its own over just the beats and audio that those segments span, so
+// that the result is identical to that of a single DownBeat run over
+// all of them.
+
+class BeatSDWorker : public AsynchronousTask
+{
+public:
+    struct Job
+    {
+        const BarBeatTrackerData *d;
+        const vector<double> *beats;
+        vector<vector<double> > results;
+        int next;
+        Mutex mutex;
+    };
+
+    BeatSDWorker(Job &job, float rate) :
+        m_job(job),
+        m_downBeat(rate, job.d->factor, job.d->dfConfig.stepSize) { }
+
+    void start() { startTask(); }
+    void await() { awaitTask(); }
+    void run() { performTask(); }
+
+protected:
+    void performTask() {
+        while (true) {
+            m_job.mutex.lock();
+            int c = m_job.next++;
+            m_job.mutex.unlock();
+            if (c >= int(m_job.results.size())) break;
+            calculate(c);
+        }
+    }
+
+    void calculate(int c) {
+
+        const BarBeatTrackerData *d = m_job.d;
+        const vector<double> &beats = *m_job.beats;
+
+        int segments = int(beats.size()) - 1;
+        int j0 = 1 + c * SDChunkBeats;
+        int j1 = std::min(j0 + SDChunkBeats, segments);
+
+        // DownBeat finds the start of each beat's audio as (beat *
+        // increment) / factor.  Make the beats relative to a point
+        // at which that is a whole number of samples, so that the
+        // same beats start at the same samples relative to the
+        // audio we copy from there
+        size_t increment = d->dfConfig.stepSize;
+        size_t factor = d->factor;
+        size_t a = increment, b = factor;
+        while (b) { size_t t = a % b; a = b; b = t; }
+        double q = double(factor / a);
+        double base = floor(beats[j0 - 1] / q) * q;
+
+        vector<double> local(beats.begin() + j0 - 1, beats.begin() + j1 + 1);
+        for (size_t i = 0; i < local.size(); ++i) local[i] -= base;
+
+        size_t from = (size_t(base) * increment) / factor;
+        size_t to = from + size_t((local[local.size()-1] * increment) / factor) + 1;
+        if (to > d->audioLength) to = d->audioLength;
+
+        // If the beats are all beyond the end of the audio, DownBeat
+        // gives them empty spectra; one sample (which it won't read)
+        // makes it do the same here
+        if (to > from) {
+            m_audio.resize(to - from);
+            d->getAudio(from, to, &m_audio[0]);
+        } else {
+            m_audio.assign(1, 0.f);
+        }
+
+        vector<int> unused;
+        m_downBeat.findDownBeats(&m_audio[0], m_audio.size(), local, unused);
+        m_downBeat.getBeatSD(m_job.results[c]);
+    }
+
+private:
+    Job &m_job;
+    DownBeat m_downBeat;
+    vector<float> m_audio;
+};
 
 BarBeatTracker::BarBeatTracker(float inputSampleRate) :
     Vamp::Plugin(inputSampleRate),
@@ -64,7 +267,8 @@ BarBeatTracker::BarBeatTracker(float inputSampleRate) :
     m_alpha(0.9), 			// changes are as per the BeatTrack.cpp
     m_tightness(4.),		// changes are as per the BeatTrack.cpp
     m_inputtempo(120.),		// changes are as per the BeatTrack.cpp
-    m_constraintempo(false) // changes are as per the BeatTrack.cpp
+    m_constraintempo(false), // changes are as per the BeatTrack.cpp
+    m_threads(1)
 {
 }
 
@@ -165,6 +369,17 @@ BarBeatTracker::getParameterDescriptors() const
     desc.valueNames.clear();
     list.push_back(desc);
 
+    desc.identifier = "threads";
+    desc.name = "Bar Detection Threads";
+    desc.description = "Number of threads across which to divide the calculation of beat spectral differences for bar detection";
+    desc.minValue = 1;
+    desc.maxValue = 32;
+    desc.defaultValue = 1;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "";
+    desc.valueNames.clear();
+    list.push_back(desc);
 
     return list;
 }
@@ -180,6 +395,8 @@ BarBeatTracker::getParameter(std::string name) const
         return m_inputtempo;
     }  else if (name == "constraintempo") {
         return m_constraintempo ? 1.0 : 0.0;
+    } else if (name == "threads") {
+        return m_threads;
     }
     return 0.0;
 }
@@ -195,6 +412,10 @@ BarBeatTracker::setParameter(std::string name, float value)
         m_inputtempo = value;
     } else if (name == "constraintempo") {
         m_constraintempo = (value > 0.5);
+    } else if (name == "threads") {
+        m_threads = lrintf(value);
+        if (m_threads < 1) m_threads = 1;
+        if (m_threads > 32) m_threads = 32;
     }
 }
 
@@ -235,7 +456,6 @@ BarBeatTracker::initialise(size_t channels, size_t stepSize, size_t blockSize)
     dfConfig.whiteningFloor = -1;
 
     m_d = new BarBeatTrackerData(m_inputSampleRate, dfConfig);
-    m_d->downBeat->setBeatsPerBar(m_bpb);
     return true;
 }
 
@@ -330,19 +550,13 @@ BarBeatTracker::process(const float *const *inputBuffers,
     }
 
     // We use time domain input, because DownBeat requires it -- so we
-    // use the time-domain version of DetectionFunction::process which
-    // does its own FFT.  It requires doubles as input, so we need to
-    // make a temporary copy
+    // do our own FFT of each block, into buffers that persist between
+    // calls, and feed the detection function from that
 
     // We only support a single input channel
 
-    const int fl = m_d->dfConfig.frameLength;
-	double *dfinput = new double[fl];
-
-	for (int i = 0; i < fl; ++i) dfinput[i] = inputBuffers[0][i];
-    double output = m_d->df->processTimeDomain(dfinput);
-
-	delete[] dfinput;
+    m_d->transform(inputBuffers[0]);
+    double output = m_d->df->processFrequencyDomain(m_d->reals, m_d->imags);
 
     if (m_d->dfOutput.empty()) m_d->origin = timestamp;
 
@@ -356,7 +570,7 @@ BarBeatTracker::process(const float *const *inputBuffers,
     // however that this means we omit the last blocksize - stepsize
     // samples completely for the purposes of barline detection
     // (hopefully not a problem)
-    m_d->downBeat->pushAudioBlock(inputBuffers[0]);
+    m_d->pushAudioBlock(inputBuffers[0]);
 
     return FeatureSet();
 }
@@ -374,6 +588,75 @@ BarBeatTracker::getRemainingFeatures()
     return barBeatTrack();
 }
 
+void
+BarBeatTracker::calculateBeatSD(const vector<double> &beats,
+                                vector<double> &beatsd) const
+{
+    if (m_d->audioLength == 0 || beats.size() < 3) return;
+
+    BeatSDWorker::Job job;
+    job.d = m_d;
+    job.beats = &beats;
+    job.next = 0;
+
+    int differences = int(beats.size()) - 2;
+    int chunks = (differences + SDChunkBeats - 1) / SDChunkBeats;
+    job.results.resize(chunks);
+
+    int threads = std::min(m_threads, chunks);
+    if (threads < 1) threads = 1;
+
+    vector<BeatSDWorker *> workers;
+    for (int i = 0; i < threads; ++i) {
+        workers.push_back(new BeatSDWorker(job, m_inputSampleRate));
+    }
+
+    for (int i = 1; i < threads; ++i) workers[i]->start();
+    workers[0]->run();
+    for (int i = 1; i < threads; ++i) workers[i]->await();
+
+    for (int i = 0; i < threads; ++i) delete workers[i];
+
+    for (int c = 0; c < chunks; ++c) {
+        beatsd.insert(beatsd.end(), job.results[c].begin(), job.results[c].end());
+    }
+}
+
+void
+BarBeatTracker::findDownBeats(const vector<double> &beatsd, int beats,
+                              vector<int> &downbeats) const
+{
+    // As DownBeat::findDownBeats, given the beat spectral differences
+
+    int timesig = m_bpb;
+    if (timesig == 0) timesig = 4;
+
+    vector<double> dbcand(timesig); // downbeat candidates
+
+    for (int beat = 0; beat < timesig; ++beat) {
+        dbcand[beat] = 0;
+    }
+
+    // look for beat transition which leads to greatest spectral change
+    for (int beat = 0; beat < timesig; ++beat) {
+        int count = 0;
+        for (int example = beat-1; example < (int)beatsd.size(); example += timesig) {
+            if (example < 0) continue;
+            dbcand[beat] += (beatsd[example]) / timesig;
+            ++count;
+        }
+        if (count > 0) dbcand[beat] /= count;
+    }
+
+    // first downbeat is beat at index of maximum value of dbcand
+    int dbind = MathUtilities::getMax(dbcand);
+
+    // remaining downbeats are at timesig intervals from the first
+    for (int i = dbind; i < beats; i += timesig) {
+        downbeats.push_back(i);
+    }
+}
+
 BarBeatTracker::FeatureSet
 BarBeatTracker::barBeatTrack()
 {
@@ -401,13 +684,13 @@ BarBeatTracker::barBeatTrack()
   //  vector<double> beats;
    // tt.calculateBeats(df, beatPeriod, beats, 0.9, 4.); // use default parameters until i fix this plugin too
 
-    vector<int> downbeats;
-    size_t downLength = 0;
-    const float *downsampled = m_d->downBeat->getBufferedAudio(downLength);
-    m_d->downBeat->findDownBeats(downsampled, downLength, beats, downbeats);
-
     vector<double> beatsd;
-    m_d->downBeat->getBeatSD(beatsd);
+    calculateBeatSD(beats, beatsd);
+
+    vector<int> downbeats;
+    if (m_d->audioLength > 0) {
+        findDownBeats(beatsd, int(beats.size()), downbeats);
+    }
 
 //    std::cerr << "BarBeatTracker: found downbeats at: ";
 //    for (int i = 0; i < downbeats.size(); ++i) std::cerr << downbeats[i] << " " << std::endl;
@@ -17,6 +17,8 @@
 
 #include <vamp-sdk/Plugin.h>
 
+#include <vector>
+
 class BarBeatTrackerData;
 
 class BarBeatTracker : public Vamp::Plugin
@@ -63,6 +65,14 @@ protected:
     double m_tightness;
     double m_inputtempo;
     bool m_constraintempo;
+
+    // Number of threads for the beat spectral difference calculation
+    int m_threads;
+
+    void calculateBeatSD(const std::vector<double> &beats,
+                         std::vector<double> &beatsd) const;
+    void findDownBeats(const std::vector<double> &beatsd, int beats,
+                       std::vector<int> &downbeats) const;
 };
 
 
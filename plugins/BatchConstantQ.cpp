@@ -0,0 +1,136 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    QM Vamp Plugin Set
+
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "BatchConstantQ.h"
+
+using std::vector;
+
+BatchConstantQ::BatchConstantQ(const CQConfig &config, int batchSize) :
+    m_batchSize(batchSize),
+    m_frames(0)
+{
+    ConstantQ cq(config);
+    cq.sparsekernel();
+
+    m_bins = cq.getK();
+
+    int n = cq.getFFTLength();
+    m_half = n/2 + 1;
+
+    // ConstantQ::process is linear in its input, and a real input of
+    // 1 in a single bin gives the kernel's weight for that bin in
+    // each output.  Bins i and n-i hold the same value once the half
+    // spectrum is mirrored, so they are probed together.  An
+    // imaginary input x contributes i x times the same weight, so
+    // needs no probe of its own.
+
+    vector<double> real(n, 0.0), imag(n, 0.0);
+    vector<double> cqre(m_bins), cqim(m_bins);
+
+    vector<vector<int> > index(m_bins);
+    vector<vector<double> > kre(m_bins), kim(m_bins);
+
+    for (int i = 0; i < m_half; ++i) {
+
+        real[i] = 1.0;
+        if (i > 0) real[n - i] = 1.0;
+
+        cq.process(&real[0], &imag[0], &cqre[0], &cqim[0]);
+
+        real[i] = 0.0;
+        if (i > 0) real[n - i] = 0.0;
+
+        for (int b = 0; b < m_bins; ++b) {
+            if (cqre[b] == 0.0 && cqim[b] == 0.0) continue;
+            index[b].push_back(i);
+            kre[b].push_back(cqre[b]);
+            kim[b].push_back(cqim[b]);
+        }
+    }
+
+    // Only the input bins read by some kernel entry are stored, and
+    // the entries index into those
+
+    vector<int> row(m_half, -1);
+    for (int b = 0; b < m_bins; ++b) {
+        for (size_t k = 0; k < index[b].size(); ++k) {
+            row[index[b][k]] = 0;
+        }
+    }
+    for (int i = 0; i < m_half; ++i) {
+        if (row[i] < 0) continue;
+        row[i] = m_used.size();
+        m_used.push_back(i);
+    }
+
+    m_start.push_back(0);
+    for (int b = 0; b < m_bins; ++b) {
+        for (size_t k = 0; k < index[b].size(); ++k) {
+            m_index.push_back(row[index[b][k]]);
+        }
+        m_kre.insert(m_kre.end(), kre[b].begin(), kre[b].end());
+        m_kim.insert(m_kim.end(), kim[b].begin(), kim[b].end());
+        m_start.push_back(m_index.size());
+    }
+
+    m_re.resize(m_used.size() * m_batchSize);
+    m_im.resize(m_used.size() * m_batchSize);
+    m_cqre.resize(m_bins * m_batchSize);
+    m_cqim.resize(m_bins * m_batchSize);
+}
+
+void
+BatchConstantQ::addFrame(const float *input)
+{
+    if (m_frames >= m_batchSize) return;
+
+    for (size_t i = 0; i < m_used.size(); ++i) {
+        m_re[i * m_batchSize + m_frames] = input[m_used[i]*2];
+        m_im[i * m_batchSize + m_frames] = input[m_used[i]*2+1];
+    }
+
+    ++m_frames;
+}
+
+void
+BatchConstantQ::process()
+{
+    int frames = m_frames;
+
+    for (int b = 0; b < m_bins; ++b) {
+
+        double *outre = &m_cqre[b * m_batchSize];
+        double *outim = &m_cqim[b * m_batchSize];
+
+        for (int f = 0; f < frames; ++f) {
+            outre[f] = 0.0;
+            outim[f] = 0.0;
+        }
+
+        for (int k = m_start[b]; k < m_start[b+1]; ++k) {
+
+            const double kr = m_kre[k];
+            const double ki = m_kim[k];
+            const double *re = &m_re[m_index[k] * m_batchSize];
+            const double *im = &m_im[m_index[k] * m_batchSize];
+
+            for (int f = 0; f < frames; ++f) {
+                outre[f] += kr * re[f] - ki * im[f];
+                outim[f] += kr * im[f] + ki * re[f];
+            }
+        }
+    }
+
+    m_frames = 0;
+}
@@ -0,0 +1,101 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    QM Vamp Plugin Set
+
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _BATCH_CONSTANT_Q_H_
+#define _BATCH_CONSTANT_Q_H_
+
+#include <dsp/chromagram/ConstantQ.h>
+
+#include <vector>
+
+/**
+ * Apply the sparse kernel of a ConstantQ to a batch of frames of
+ * frequency-domain input at once, as a single sparse-by-dense matrix
+ * multiplication, instead of one frame at a time.  Each kernel value
+ * is then loaded once per batch rather than once per frame.
+ *
+ * Frames are given as supplied by the Vamp host: the first half of
+ * the spectrum, as interleaved real and imaginary floats.  The
+ * plugins mirror this into the full-length spectrum that ConstantQ
+ * takes.  Here the kernel entries that read the same input value in
+ * the mirrored spectrum are combined, so no mirroring is needed.
+ *
+ * ConstantQ does not make its kernel available, so it is recovered
+ * on construction by running the ConstantQ on a unit impulse in each
+ * bin of the half spectrum.  That costs one ConstantQ::process call
+ * per bin.  Results are the same as from ConstantQ::process, except
+ * for rounding, as the kernel entries are summed in a different order.
+ */
+class BatchConstantQ
+{
+public:
+    BatchConstantQ(const CQConfig &config, int batchSize);
+
+    int getBinCount() const { return m_bins; }
+    int getBatchSize() const { return m_batchSize; }
+
+    /**
+     * Return the number of frames added since the last call to
+     * process (or clear).
+     */
+    int getFrameCount() const { return m_frames; }
+
+    /**
+     * Add a frame of interleaved half-spectrum input.  There must be
+     * fewer than getBatchSize() frames already added.
+     */
+    void addFrame(const float *input);
+
+    /**
+     * Calculate the constant-Q output for all frames added.  The
+     * real and imaginary parts of bin b in frame f are then at index
+     * b * getBatchSize() + f in getReal() and getImag().  The frames
+     * are cleared, ready for the next batch.
+     */
+    void process();
+
+    const double *getReal() const { return &m_cqre[0]; }
+    const double *getImag() const { return &m_cqim[0]; }
+
+    /**
+     * Discard any frames added and not yet processed.
+     */
+    void clear() { m_frames = 0; }
+
+protected:
+    int m_bins;
+    int m_half;       // bins in the half spectrum
+    int m_batchSize;
+    int m_frames;
+
+    // The half-spectrum bins read by the kernel, in order
+    std::vector<int> m_used;
+
+    // The kernel, by constant-Q bin: the entries for bin b are those
+    // from m_start[b] to m_start[b+1], each reading the input bin at
+    // m_used[m_index[i]] with weight m_kre[i] + i m_kim[i]
+    std::vector<int> m_start;
+    std::vector<int> m_index;
+    std::vector<double> m_kre;
+    std::vector<double> m_kim;
+
+    // Input (of the bins in m_used only) and output, indexed by
+    // bin * m_batchSize + frame
+    std::vector<double> m_re;
+    std::vector<double> m_im;
+    std::vector<double> m_cqre;
+    std::vector<double> m_cqim;
+};
+
+#endif
@@ -13,12 +13,18 @@
 */
 
 #include "BeatTrack.h"
+#include "Deinterleave.h"
+#include "SharedDetectionFunction.h"
 
 #include <dsp/onsets/DetectionFunction.h>
 #include <dsp/onsets/PeakPicking.h>
 #include <dsp/tempotracking/TempoTrack.h>
 #include <dsp/tempotracking/TempoTrackV2.h>
 
+#include <thread/AsynchronousTask.h>
+
+#include <algorithm>
+
 using std::string;
 using std::vector;
 using std::cerr;
@@ -29,26 +35,101 @@ float BeatTracker::m_stepSecs = 0.01161; // 512 samples at 44100
 #define METHOD_OLD 0
 #define METHOD_NEW 1
 
+// In online mode, the beat tracker is re-run every OnlineInterval
+// seconds over the most recent OnlineHistory seconds of detection
+// function plus the look-ahead
+static const float OnlineHistory = 10.f;
+static const float OnlineInterval = 1.f;
+
+// TempoTrackV2 estimates the beat period from windows of PeriodWindow
+// detection function frames, PeriodStep frames apart.  When this is
+// done in parallel, the detection function is divided into sections
+// made up of whole steps, each of which is analysed with an extra
+// SectionOverlap steps of context either side, so that the Viterbi
+// path through the estimates has settled by the time it reaches the
+// part of the section that is actually used.  The sections are only
+// used if each agrees with the next throughout their overlap.  That
+// makes it very likely, but does not prove, that the spliced path is
+// the one a single Viterbi decoding of the whole input would find.
+static const int PeriodWindow = 512;
+static const int PeriodStep = 128;
+static const int SectionOverlap = 32;
+
+class BeatPeriodSection : public AsynchronousTask
+{
+public:
+    BeatPeriodSection(float rate, int stepSize,
+                      const vector<double> &df, int from, int to,
+                      double inputtempo, bool constraintempo) :
+        m_tt(rate, stepSize),
+        m_df(df.begin() + from, df.begin() + to),
+        m_inputtempo(inputtempo),
+        m_constraintempo(constraintempo) {
+        beatPeriod.resize(m_df.size(), 0.0);
+    }
+
+    void start() { startTask(); }
+    void await() { awaitTask(); }
+    void run() { performTask(); }
+
+    vector<double> beatPeriod;
+    vector<double> tempi;
+
+protected:
+    void performTask() {
+        m_tt.calculateBeatPeriod(m_df, beatPeriod, tempi,
+                                 m_inputtempo, m_constraintempo);
+    }
+
+private:
+    TempoTrackV2 m_tt;
+    vector<double> m_df;
+    double m_inputtempo;
+    bool m_constraintempo;
+};
+
 class BeatTrackerData
 {
 public:
-    BeatTrackerData(const DFConfig &config) : dfConfig(config) {
-    df = new DetectionFunction(config);
+    BeatTrackerData(const DFConfig &config) :
+        dfConfig(config), spectrum(config.frameLength / 2 + 1) {
+    df = new SharedDetectionFunction(config);
+        dfBase = 0;
+        nextUpdate = 0;
+        reported = 2;
+        lastBeat = -1.0;
+        prevTempo = 0.0;
     }
     ~BeatTrackerData() {
     delete df;
     }
     void reset() {
     delete df;
-    df = new DetectionFunction(dfConfig);
+    df = new SharedDetectionFunction(dfConfig);
     dfOutput.clear();
         origin = Vamp::RealTime::zeroTime;
+        dfBase = 0;
+        nextUpdate = 0;
+        reported = 2;
+        lastBeat = -1.0;
+        prevTempo = 0.0;
     }
 
     DFConfig dfConfig;
-    DetectionFunction *df;
+    SharedDetectionFunction *df;
+    DeinterleavedSpectrum spectrum;
     vector<double> dfOutput;
     Vamp::RealTime origin;
+
+    // Online mode only.  dfOutput holds the detection function from
+    // frame dfBase onwards; earlier frames have been discarded.
+    // Beats and tempi before frame reported have been returned, the
+    // latest beat being at frame lastBeat.
+    int dfBase;
+    int nextUpdate;
+    int reported;
+    double lastBeat;
+    double prevTempo;
 };
 
 
@@ -62,8 +143,11 @@ BeatTracker::BeatTracker(float inputSampleRate) :
     m_inputtempo(120.), 	// MEPD new exposed parameter for beat tracker, default value = 120. (as old version)
     m_constraintempo(false), // MEPD new exposed parameter for beat tracker, default value = false (as old version)
     // calling the beat tracker with these default parameters will give the same output as the previous existing version
-    m_whiten(false)
-
+    m_whiten(false),
+    m_online(false),
+    m_lookahead(6.f),
+    m_threads(1),
+    m_compact(false)
 {
 }
 
@@ -192,7 +276,52 @@ BeatTracker::getParameterDescriptors() const
     desc.valueNames.clear();
     list.push_back(desc);
 
+    desc.identifier = "online";
+    desc.name = "Online Tracking";
+    desc.description = "Report beats and tempo as the input is processed, after a fixed look-ahead, rather than at the end (new method only)";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = 0;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "";
+    desc.valueNames.clear();
+    list.push_back(desc);
+
+    desc.identifier = "lookahead";
+    desc.name = "Online Look-ahead";
+    desc.description = "In online tracking, how far ahead of a beat the input must have been processed before the beat is reported";
+    desc.minValue = 2;
+    desc.maxValue = 20;
+    desc.defaultValue = 6;
+    desc.isQuantized = false;
+    desc.unit = "s";
+    desc.valueNames.clear();
+    list.push_back(desc);
 
+    desc.identifier = "compact";
+    desc.name = "Compact Output";
+    desc.description = "Return all beats found at once as the values of a single feature, timestamped at the first beat, and omit the labels from beats and tempo";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = 0;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "";
+    desc.valueNames.clear();
+    list.push_back(desc);
+
+    desc.identifier = "threads";
+    desc.name = "Tempo Estimation Threads";
+    desc.description = "Number of threads across which to divide the beat period estimation at the end of the input (new method only).  The result is approximate: it almost always matches that of a single thread, but is not guaranteed to";
+    desc.minValue = 1;
+    desc.maxValue = 32;
+    desc.defaultValue = 1;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "";
+    desc.valueNames.clear();
+    list.push_back(desc);
 
     return list;
 }
@@ -218,6 +347,14 @@ BeatTracker::getParameter(std::string name) const
         return m_inputtempo;
     }  else if (name == "constraintempo") {
         return m_constraintempo ? 1.0 : 0.0;
+    } else if (name == "online") {
+        return m_online ? 1.0 : 0.0;
+    } else if (name == "lookahead") {
+        return m_lookahead;
+    } else if (name == "threads") {
+        return m_threads;
+    } else if (name == "compact") {
+        return m_compact ? 1.0 : 0.0;
     }
     return 0.0;
 }
@@ -243,6 +380,16 @@ BeatTracker::setParameter(std::string name, float value)
         m_inputtempo = value;
     } else if (name == "constraintempo") {
         m_constraintempo = (value > 0.5);
+    } else if (name == "online") {
+        m_online = (value > 0.5);
+    } else if (name == "lookahead") {
+        m_lookahead = value;
+    } else if (name == "threads") {
+        m_threads = lrintf(value);
+        if (m_threads < 1) m_threads = 1;
+        if (m_threads > 32) m_threads = 32;
+    } else if (name == "compact") {
+        m_compact = (value > 0.5);
     }
 }
 
@@ -323,6 +470,11 @@ BeatTracker::getOutputDescriptors() const
     beat.unit = "";
     beat.hasFixedBinCount = true;
     beat.binCount = 0;
+    if (m_compact) {
+        beat.description = "Estimated metrical beat locations, as the times in seconds of all beats found at once";
+        beat.unit = "s";
+        beat.hasFixedBinCount = false;
+    }
     beat.sampleType = OutputDescriptor::VariableSampleRate;
     beat.sampleRate = 1.0 / m_stepSecs;
 
@@ -367,22 +519,12 @@ BeatTracker::process(const float *const *inputBuffers,
     return FeatureSet();
     }
 
-    size_t len = m_d->dfConfig.frameLength / 2 + 1;
-
-    double *reals = new double[len];
-    double *imags = new double[len];
-
     // We only support a single input channel
 
-    for (size_t i = 0; i < len; ++i) {
-        reals[i] = inputBuffers[0][i*2];
-        imags[i] = inputBuffers[0][i*2+1];
-    }
+    m_d->spectrum.deinterleave(inputBuffers[0]);
 
-    double output = m_d->df->processFrequencyDomain(reals, imags);
-
-    delete[] reals;
-    delete[] imags;
+    double output = m_d->df->processFrequencyDomain(m_d->spectrum.reals,
+                                                    m_d->spectrum.imags);
 
     if (m_d->dfOutput.empty()) m_d->origin = timestamp;
 
@@ -390,6 +532,10 @@ BeatTracker::process(const float *const *inputBuffers,
 
     FeatureSet returnFeatures;
 
+    if (m_online && m_method == METHOD_NEW) {
+        returnFeatures = beatTrackOnline(false);
+    }
+
     Feature feature;
     feature.hasTimestamp = false;
     feature.values.push_back(output);
@@ -409,6 +555,7 @@ BeatTracker::getRemainingFeatures()
     }
 
     if (m_method == METHOD_OLD) return beatTrackOld();
+    else if (m_online) return beatTrackOnline(true);
     else return beatTrackNew();
 }
 
@@ -437,7 +584,11 @@ BeatTracker::beatTrackOld()
 
     char label[100];
 
-    for (size_t i = 0; i < beats.size(); ++i) {
+    if (m_compact && !beats.empty()) {
+        returnFeatures[0].push_back(compactBeats(beats, 0)); // beats are output 0
+    }
+
+    for (size_t i = 0; i < beats.size() && !m_compact; ++i) {
 
     size_t frame = beats[i] * m_d->dfConfig.stepSize;
 
@@ -482,8 +633,10 @@ BeatTracker::beatTrackOld()
             feature.timestamp = m_d->origin + Vamp::RealTime::frame2RealTime
                 (frame, lrintf(m_inputSampleRate));
             feature.values.push_back(tempi[i]);
-            sprintf(label, "%.2f bpm", tempi[i]);
-            feature.label = label;
+            if (!m_compact) {
+                sprintf(label, "%.2f bpm", tempi[i]);
+                feature.label = label;
+            }
             returnFeatures[2].push_back(feature); // tempo is output 2
             prevTempo = tempi[i];
         }
@@ -517,9 +670,12 @@ BeatTracker::beatTrackNew()
 
     TempoTrackV2 tt(m_inputSampleRate, m_d->dfConfig.stepSize);
 
-
-    // MEPD - note this function is now passed 2 new parameters, m_inputtempo and m_constraintempo
-    tt.calculateBeatPeriod(df, beatPeriod, tempi, m_inputtempo, m_constraintempo);
+    if (m_threads > 1) {
+        calculateBeatPeriodSectioned(df, beatPeriod, tempi);
+    } else {
+        // MEPD - note this function is now passed 2 new parameters, m_inputtempo and m_constraintempo
+        tt.calculateBeatPeriod(df, beatPeriod, tempi, m_inputtempo, m_constraintempo);
+    }
 
     vector<double> beats;
 
@@ -530,7 +686,11 @@ BeatTracker::beatTrackNew()
 
     char label[100];
 
-    for (size_t i = 0; i < beats.size(); ++i) {
+    if (m_compact && !beats.empty()) {
+        returnFeatures[0].push_back(compactBeats(beats, 0)); // beats are output 0
+    }
+
+    for (size_t i = 0; i < beats.size() && !m_compact; ++i) {
 
     size_t frame = beats[i] * m_d->dfConfig.stepSize;
 
@@ -573,8 +733,10 @@ BeatTracker::beatTrackNew()
             feature.timestamp = m_d->origin + Vamp::RealTime::frame2RealTime
                 (frame, lrintf(m_inputSampleRate));
             feature.values.push_back(tempi[i]);
-            sprintf(label, "%.2f bpm", tempi[i]);
-            feature.label = label;
+            if (!m_compact) {
+                sprintf(label, "%.2f bpm", tempi[i]);
+                feature.label = label;
+            }
             returnFeatures[2].push_back(feature); // tempo is output 2
             prevTempo = tempi[i];
         }
@@ -582,3 +744,275 @@ BeatTracker::beatTrackNew()
 
     return returnFeatures;
 }
+
+template <typename T>
+BeatTracker::Feature
+BeatTracker::compactBeats(const vector<T> &beats, int offset) const
+{
+    // A single feature for all of the given beats (detection function
+    // frame numbers, to which offset is added), timestamped at the
+    // first of them, with the time in seconds of each beat as its
+    // values
+
+    size_t step = m_d->dfConfig.stepSize;
+    int rate = lrintf(m_inputSampleRate);
+
+    Feature feature;
+    feature.hasTimestamp = true;
+    feature.values.reserve(beats.size());
+
+    for (size_t i = 0; i < beats.size(); ++i) {
+        size_t frame = (beats[i] + offset) * step;
+        Vamp::RealTime t =
+            m_d->origin + Vamp::RealTime::frame2RealTime(frame, rate);
+        if (i == 0) feature.timestamp = t;
+        feature.values.push_back(t.sec + t.nsec / 1000000000.0);
+    }
+
+    return feature;
+}
+
+void
+BeatTracker::calculateBeatPeriodSectioned(const vector<double> &df,
+                                          vector<double> &beatPeriod,
+                                          vector<double> &tempi)
+{
+    // Divide the estimation windows into one section per thread and
+    // analyse each section (plus its overlap) with a separate
+    // TempoTrackV2, then take from each the beat period and tempo for
+    // the frames belonging to that section.  Sections are aligned to
+    // whole steps, so every section sees exactly the same windows as
+    // a single TempoTrackV2 run across the whole input would.
+    //
+    // Each section decodes its own Viterbi path, which starts and
+    // ends without the context of its neighbours.  If any two
+    // neighbouring sections differ anywhere in the overlap they
+    // share, their paths have not converged, and the whole input is
+    // analysed with a single TempoTrackV2 instead.  Agreement in the
+    // overlap does not guarantee that the paths outside it match the
+    // single run's, as TempoTrackV2 keeps the Viterbi state that
+    // would show this to itself, so the result is approximate.
+
+    int n = int(df.size());
+    int windows = 0;
+    while (windows * PeriodStep + PeriodWindow < n) ++windows;
+
+    int per = (windows + m_threads - 1) / m_threads;
+    if (per < SectionOverlap * 4) per = SectionOverlap * 4;
+    int sections = (windows + per - 1) / per;
+
+    if (sections < 2) {
+        TempoTrackV2 tt(m_inputSampleRate, m_d->dfConfig.stepSize);
+        tt.calculateBeatPeriod(df, beatPeriod, tempi,
+                               m_inputtempo, m_constraintempo);
+        return;
+    }
+
+    vector<BeatPeriodSection *> tasks;
+    vector<int> starts;
+
+    for (int i = 0; i < sections; ++i) {
+        int first = i * per - SectionOverlap;
+        if (first < 0) first = 0;
+        int from = first * PeriodStep;
+        int to = n;
+        if (i + 1 < sections) {
+            to = ((i + 1) * per + SectionOverlap) * PeriodStep + PeriodWindow + 1;
+            if (to > n) to = n;
+        }
+        tasks.push_back(new BeatPeriodSection
+                        (m_inputSampleRate, m_d->dfConfig.stepSize,
+                         df, from, to, m_inputtempo, m_constraintempo));
+        starts.push_back(from);
+    }
+
+    for (int i = 1; i < sections; ++i) tasks[i]->start();
+    tasks[0]->run();
+    for (int i = 1; i < sections; ++i) tasks[i]->await();
+
+    bool converged = true;
+
+    for (int i = 0; i + 1 < sections && converged; ++i) {
+        int from = ((i + 1) * per - SectionOverlap) * PeriodStep;
+        int to = ((i + 1) * per + SectionOverlap) * PeriodStep;
+        if (to > n) to = n;
+        for (int j = from; j < to; ++j) {
+            if (tasks[i]->beatPeriod[j - starts[i]] !=
+                tasks[i+1]->beatPeriod[j - starts[i+1]]) {
+                converged = false;
+                break;
+            }
+        }
+    }
+
+    if (!converged) {
+        for (int i = 0; i < sections; ++i) delete tasks[i];
+        TempoTrackV2 tt(m_inputSampleRate, m_d->dfConfig.stepSize);
+        tt.calculateBeatPeriod(df, beatPeriod, tempi,
+                               m_inputtempo, m_constraintempo);
+        return;
+    }
+
+    tempi.clear();
+
+    for (int i = 0; i < sections; ++i) {
+        int from = i * per * PeriodStep;
+        int to = (i + 1 < sections ? (i + 1) * per * PeriodStep : n);
+        const BeatPeriodSection *t = tasks[i];
+        for (int j = from; j < to; ++j) {
+            int k = j - starts[i];
+            beatPeriod[j] = t->beatPeriod[k];
+            if (k < int(t->tempi.size())) tempi.push_back(t->tempi[k]);
+        }
+        delete tasks[i];
+    }
+}
+
+BeatTracker::FeatureSet
+BeatTracker::beatTrackOnline(bool final)
+{
+    // Run the new method over a window consisting of the most recent
+    // OnlineHistory seconds of detection function plus the
+    // look-ahead, and report the beats and tempi found in it that
+    // fall before the look-ahead and after what has already been
+    // reported.  Frame numbers here are indices into the whole
+    // detection function, of which (as in beatTrackNew) the first two
+    // elements are discarded.  Beat and tempo times are then
+    // calculated exactly as in beatTrackNew.
+
+    FeatureSet returnFeatures;
+
+    size_t step = m_d->dfConfig.stepSize;
+    float frameRate = m_inputSampleRate / step;
+
+    int lookahead = int(m_lookahead * frameRate + 0.5);
+    int history = int(OnlineHistory * frameRate + 0.5);
+    int end = m_d->dfBase + int(m_d->dfOutput.size());
+
+    if (!final) {
+        if (end < m_d->nextUpdate) return returnFeatures;
+        m_d->nextUpdate = end + int(OnlineInterval * frameRate + 0.5);
+    }
+
+    int from = end - history - lookahead;
+    if (from < m_d->dfBase) from = m_d->dfBase;
+    if (from < 2) from = 2;
+
+    if (final) {
+        while (end > from) {
+            if (m_d->dfOutput[end - 1 - m_d->dfBase] > 0.0) {
+                break;
+            }
+            --end;
+        }
+    }
+
+    // TempoTrackV2 estimates the beat period over 512-frame windows,
+    // and needs at least one of those to work with.  Windows are run
+    // as soon as there is one, before the full history is available,
+    // and beats before the look-ahead are reported from them.  So
+    // the online output can differ from the offline output even for
+    // an input shorter than OnlineHistory plus the look-ahead.
+    if (end - from <= 512 && !(final && m_d->reported == 2)) {
+        return returnFeatures;
+    }
+    if (end <= from) return returnFeatures;
+
+    vector<double> df(m_d->dfOutput.begin() + (from - m_d->dfBase),
+                      m_d->dfOutput.begin() + (end - m_d->dfBase));
+    vector<double> beatPeriod(df.size(), 0.0);
+    vector<double> tempi;
+
+    TempoTrackV2 tt(m_inputSampleRate, step);
+    tt.calculateBeatPeriod(df, beatPeriod, tempi, m_inputtempo, m_constraintempo);
+
+    vector<double> beats;
+    tt.calculateBeats(df, beatPeriod, beats, m_alpha, m_tightness);
+
+    int limit = (final ? end : end - lookahead);
+
+    char label[100];
+
+    vector<double> compact;
+
+    for (size_t i = 0; i < beats.size(); ++i) {
+
+        double beat = from + beats[i];
+        if (beat >= limit) break;
+
+        // Beats reported from an earlier window may have moved
+        // slightly in this one; skip any within half a beat of the
+        // last one reported
+        double period = beatPeriod[int(beats[i])];
+        if (m_d->lastBeat >= 0.0 && beat < m_d->lastBeat + period / 2) {
+            continue;
+        }
+
+        m_d->lastBeat = beat;
+
+        if (m_compact) {
+            compact.push_back(beats[i]);
+            continue;
+        }
+
+        size_t frame = (beat - 2) * step;
+
+        Feature feature;
+        feature.hasTimestamp = true;
+        feature.timestamp = m_d->origin + Vamp::RealTime::frame2RealTime
+            (frame, lrintf(m_inputSampleRate));
+
+        if (i+1 < beats.size()) {
+
+            int frameIncrement = (beats[i+1] - beats[i]) * step;
+
+            if (frameIncrement > 0) {
+                float bpm = (60.0 * m_inputSampleRate) / frameIncrement;
+                bpm = int(bpm * 100.0 + 0.5) / 100.0;
+                sprintf(label, "%.2f bpm", bpm);
+                feature.label = label;
+            }
+        }
+
+        returnFeatures[0].push_back(feature); // beats are output 0
+    }
+
+    if (!compact.empty()) {
+        returnFeatures[0].push_back(compactBeats(compact, from - 2));
+    }
+
+    for (int i = std::max(m_d->reported, from);
+         i < limit && i - from < int(tempi.size()); ++i) {
+
+        double tempo = tempi[i - from];
+        size_t frame = (i - 2) * step;
+
+        if (tempo > 1 && int(tempo * 100) != int(m_d->prevTempo * 100)) {
+            Feature feature;
+            feature.hasTimestamp = true;
+            feature.timestamp = m_d->origin + Vamp::RealTime::frame2RealTime
+                (frame, lrintf(m_inputSampleRate));
+            feature.values.push_back(tempo);
+            if (!m_compact) {
+                sprintf(label, "%.2f bpm", tempo);
+                feature.label = label;
+            }
+            returnFeatures[2].push_back(feature); // tempo is output 2
+            m_d->prevTempo = tempo;
+        }
+    }
+
+    if (limit > m_d->reported) m_d->reported = limit;
+
+    // Discard detection function that no later window will include
+
+    int keep = m_d->nextUpdate - history - lookahead;
+    if (keep > m_d->dfBase) {
+        int discard = std::min(keep - m_d->dfBase, int(m_d->dfOutput.size()));
+        m_d->dfOutput.erase(m_d->dfOutput.begin(),
+                            m_d->dfOutput.begin() + discard);
+        m_d->dfBase += discard;
+    }
+
+    return returnFeatures;
+}
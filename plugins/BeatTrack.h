@@ -17,6 +17,8 @@
 
 #include <vamp-sdk/Plugin.h>
 
+#include <vector>
+
 class BeatTrackerData;
 
 class BeatTracker : public Vamp::Plugin
@@ -63,9 +65,30 @@ protected:
     bool m_constraintempo;
 
     bool m_whiten;
+
+    // Online tracking, in which beats and tempo are reported from
+    // process() once they are m_lookahead seconds behind the input
+    bool m_online;
+    float m_lookahead;
+
+    // Number of threads used to estimate the beat period in the new
+    // method (1 for the original single TempoTrackV2 run)
+    int m_threads;
+
+    // Return all beats in a single feature, without labels
+    bool m_compact;
+
     static float m_stepSecs;
     FeatureSet beatTrackOld();
     FeatureSet beatTrackNew();
+    FeatureSet beatTrackOnline(bool final);
+
+    template <typename T>
+    Feature compactBeats(const std::vector<T> &beats, int offset) const;
+
+    void calculateBeatPeriodSectioned(const std::vector<double> &df,
+                                      std::vector<double> &beatPeriod,
+                                      std::vector<double> &tempi);
 };
 
 
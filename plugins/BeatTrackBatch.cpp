@@ -0,0 +1,219 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    QM Vamp Plugin Set
+
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "BeatTrackBatch.h"
+
+#include <dsp/onsets/DetectionFunction.h>
+#include <dsp/tempotracking/TempoTrackV2.h>
+
+#include <thread/Thread.h>
+#include <thread/AsynchronousTask.h>
+
+#include <algorithm>
+#include <chrono>
+
+using std::vector;
+
+// As BeatTracker::m_stepSecs
+static const float StepSecs = 0.01161;
+
+BeatTrackBatch::Parameters::Parameters() :
+    sampleRate(44100),
+    dfType(DF_COMPLEXSD),
+    whiten(false),
+    alpha(0.9),
+    tightness(4.),
+    inputtempo(120.),
+    constraintempo(false)
+{
+}
+
+// Each worker takes the next unprocessed track from the list until
+// there are none left.  Worker 0 runs on the calling thread.
+class BeatTrackBatch::Worker : public AsynchronousTask
+{
+public:
+    Worker(BeatTrackBatch *batch, vector<Track> &tracks,
+           Mutex &mutex, size_t &next) :
+        tt(batch->m_params.sampleRate, batch->m_step),
+        frame(batch->getBlockSize(), 0.0),
+        m_batch(batch),
+        m_tracks(tracks),
+        m_mutex(mutex),
+        m_next(next) { }
+
+    void start() { startTask(); }
+    void await() { awaitTask(); }
+    void run() { performTask(); }
+
+    TempoTrackV2 tt;
+    vector<double> frame;
+
+protected:
+    void performTask() {
+        while (true) {
+            m_mutex.lock();
+            size_t i = m_next++;
+            m_mutex.unlock();
+            if (i >= m_tracks.size()) break;
+            m_batch->processTrack(m_tracks[i], this);
+        }
+    }
+
+private:
+    BeatTrackBatch *m_batch;
+    vector<Track> &m_tracks;
+    Mutex &m_mutex;
+    size_t &m_next;
+};
+
+BeatTrackBatch::BeatTrackBatch(const Parameters &parameters) :
+    m_params(parameters)
+{
+    // As BeatTracker::getPreferredStepSize
+    m_step = int(m_params.sampleRate * StepSecs + 0.0001);
+}
+
+BeatTrackBatch::~BeatTrackBatch()
+{
+}
+
+BeatTrackBatch::Throughput
+BeatTrackBatch::process(vector<Track> &tracks, int threads)
+{
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+
+    if (threads > int(tracks.size())) threads = int(tracks.size());
+    if (threads < 1) threads = 1;
+
+    Mutex mutex;
+    size_t next = 0;
+
+    vector<Worker *> workers;
+    for (int i = 0; i < threads; ++i) {
+        workers.push_back(new Worker(this, tracks, mutex, next));
+    }
+
+    for (int i = 1; i < threads; ++i) workers[i]->start();
+    workers[0]->run();
+    for (int i = 1; i < threads; ++i) workers[i]->await();
+
+    for (int i = 0; i < threads; ++i) delete workers[i];
+
+    Throughput throughput;
+    throughput.tracks = int(tracks.size());
+    for (size_t i = 0; i < tracks.size(); ++i) {
+        throughput.duration += tracks[i].duration;
+    }
+    throughput.elapsed = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+
+    return throughput;
+}
+
+void
+BeatTrackBatch::processTrack(Track &track, Worker *worker)
+{
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+
+    track.beats.clear();
+    track.tempo = 0;
+
+    if (!track.audio.empty()) {
+
+        // As BeatTracker::initialise
+        DFConfig dfConfig;
+        dfConfig.DFType = m_params.dfType;
+        dfConfig.stepSize = m_step;
+        dfConfig.frameLength = getBlockSize();
+        dfConfig.dbRise = 3;
+        dfConfig.adaptiveWhitening = m_params.whiten;
+        dfConfig.whiteningRelaxCoeff = -1;
+        dfConfig.whiteningFloor = -1;
+
+        DetectionFunction df(dfConfig);
+
+        // One frame for each step, starting at the first sample and
+        // continuing until the input is used up, as a host would
+        // supply them
+        int n = int(track.audio.size());
+        int block = getBlockSize();
+        vector<double> &frame = worker->frame;
+
+        track.df.clear();
+        for (int i = 0; i < n; i += m_step) {
+            for (int j = 0; j < block; ++j) {
+                frame[j] = (i + j < n ? track.audio[i + j] : 0.0);
+            }
+            track.df.push_back(df.processTimeDomain(&frame[0]));
+        }
+
+        track.duration = double(n) / m_params.sampleRate;
+        vector<float>().swap(track.audio);
+
+    } else {
+        track.duration =
+            double(track.df.size()) * m_step / m_params.sampleRate;
+    }
+
+    // The rest is as BeatTracker::beatTrackNew
+
+    size_t nonZeroCount = track.df.size();
+    while (nonZeroCount > 0) {
+        if (track.df[nonZeroCount-1] > 0.0) {
+            break;
+        }
+        --nonZeroCount;
+    }
+
+    vector<double> df;
+    for (size_t i = 2; i < nonZeroCount; ++i) { // discard first two elts
+        df.push_back(track.df[i]);
+    }
+    vector<double>().swap(track.df);
+
+    if (!df.empty()) {
+
+        vector<double> beatPeriod(df.size(), 0.0);
+        vector<double> tempi;
+        vector<double> beats;
+
+        worker->tt.calculateBeatPeriod(df, beatPeriod, tempi,
+                                       m_params.inputtempo,
+                                       m_params.constraintempo);
+
+        worker->tt.calculateBeats(df, beatPeriod, beats,
+                                  m_params.alpha, m_params.tightness);
+
+        for (size_t i = 0; i < beats.size(); ++i) {
+            size_t frame = beats[i] * m_step;
+            track.beats.push_back(double(frame) / m_params.sampleRate);
+        }
+
+        vector<double> valid;
+        for (size_t i = 0; i < tempi.size(); ++i) {
+            if (tempi[i] > 1) valid.push_back(tempi[i]);
+        }
+        if (!valid.empty()) {
+            vector<double>::iterator mid = valid.begin() + valid.size() / 2;
+            std::nth_element(valid.begin(), mid, valid.end());
+            track.tempo = *mid;
+        }
+    }
+
+    track.elapsed = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,109 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    QM Vamp Plugin Set
+
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _BEAT_TRACK_BATCH_H_
+#define _BEAT_TRACK_BATCH_H_
+
+#include <vector>
+#include <string>
+
+/**
+ * Run the beat tracker of the qm-tempotracker plugin (new method
+ * only) over many tracks at once, without creating a plugin instance
+ * and running it through a host for each one.  Tracks are shared out
+ * across a number of threads, each of which keeps its own tempo
+ * tracker for all the tracks it processes.
+ *
+ * Given the detection function returned by the plugin's
+ * detection_fn output, the beats found are identical to those from
+ * the plugin.  Given audio, the detection function is calculated here
+ * from the time domain input, which may differ from the plugin run
+ * through a host by rounding in the host's window and FFT.
+ */
+class BeatTrackBatch
+{
+public:
+    struct Parameters
+    {
+        Parameters();
+
+        float sampleRate;   // of all audio input, default 44100
+        int dfType;         // DF_ type, default DF_COMPLEXSD
+        bool whiten;
+        double alpha;
+        double tightness;
+        double inputtempo;
+        bool constraintempo;
+    };
+
+    struct Track
+    {
+        Track() : tempo(0), duration(0), elapsed(0) { }
+
+        std::string name;
+
+        // Input: mono audio at the batch sample rate, or, if audio is
+        // empty, a detection function at the plugin's step size
+        std::vector<float> audio;
+        std::vector<double> df;
+
+        // Results: beat times in seconds, median tempo in bpm (0 if
+        // no tempo was found), duration of the input in seconds, and
+        // the time taken to process it in seconds
+        std::vector<double> beats;
+        double tempo;
+        double duration;
+        double elapsed;
+    };
+
+    struct Throughput
+    {
+        Throughput() : tracks(0), duration(0), elapsed(0) { }
+
+        int tracks;
+        double duration;    // total duration of all input, in seconds
+        double elapsed;     // wall-clock time taken, in seconds
+
+        double getTracksPerSecond() const {
+            return elapsed > 0 ? tracks / elapsed : 0;
+        }
+        double getRealTimeFactor() const {
+            return elapsed > 0 ? duration / elapsed : 0;
+        }
+    };
+
+    BeatTrackBatch(const Parameters &parameters);
+    ~BeatTrackBatch();
+
+    int getStepSize() const { return m_step; }
+    int getBlockSize() const { return m_step * 2; }
+
+    /**
+     * Process all of the given tracks using up to the given number of
+     * threads, filling in their results.  The audio and detection
+     * function of each track are released once it has been processed.
+     */
+    Throughput process(std::vector<Track> &tracks, int threads);
+
+protected:
+    Parameters m_params;
+    int m_step;
+
+    class Worker;
+    friend class Worker;
+
+    void processTrack(Track &track, Worker *worker);
+};
+
+#endif
@@ -13,10 +13,13 @@
 */
 
 #include "ChromagramPlugin.h"
+#include "BatchConstantQ.h"
 
 #include <base/Pitch.h>
 #include <dsp/chromagram/Chromagram.h>
 
+#include <cmath>
+
 using std::string;
 using std::vector;
 using std::cerr;
@@ -25,14 +28,17 @@ using std::endl;
 ChromagramPlugin::ChromagramPlugin(float inputSampleRate) :
     Vamp::Plugin(inputSampleRate),
     m_chromagram(0),
+    m_batch(0),
     m_step(0),
-    m_block(0)
+    m_block(0),
+    m_stepSize(0)
 {
     m_minMIDIPitch = 36;
     m_maxMIDIPitch = 96;
     m_tuningFrequency = 440;
     m_normalise = MathUtilities::NormaliseNone;
     m_bpo = 12;
+    m_batchSize = 1;
 
     setupConfig();
 }
@@ -56,6 +62,7 @@ ChromagramPlugin::setupConfig()
 ChromagramPlugin::~ChromagramPlugin()
 {
     delete m_chromagram;
+    delete m_batch;
 }
 
 string
@@ -157,6 +164,18 @@ ChromagramPlugin::getParameterDescriptors() const
     desc.valueNames.push_back("Unit Maximum");
     list.push_back(desc);
 
+    desc.identifier = "batch";
+    desc.name = "Frames per Batch";
+    desc.unit = "frames";
+    desc.description = "Number of process blocks to gather and transform together.  More than one is faster, but delays the output until a batch is complete";
+    desc.minValue = 1;
+    desc.maxValue = 64;
+    desc.defaultValue = 1;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.valueNames.clear();
+    list.push_back(desc);
+
     return list;
 }
 
@@ -178,6 +197,9 @@ ChromagramPlugin::getParameter(std::string param) const
     if (param == "normalization") {
         return int(m_normalise);
     }
+    if (param == "batch") {
+        return m_batchSize;
+    }
     std::cerr << "WARNING: ChromagramPlugin::getParameter: unknown parameter \""
               << param << "\"" << std::endl;
     return 0.0;
@@ -196,6 +218,9 @@ ChromagramPlugin::setParameter(std::string param, float value)
         m_bpo = lrintf(value);
     } else if (param == "normalization") {
         m_normalise = MathUtilities::NormaliseType(int(value + 0.0001));
+    } else if (param == "batch") {
+        m_batchSize = lrintf(value);
+        if (m_batchSize < 1) m_batchSize = 1;
     } else {
         std::cerr << "WARNING: ChromagramPlugin::setParameter: unknown parameter \""
                   << param << "\"" << std::endl;
@@ -213,6 +238,9 @@ ChromagramPlugin::initialise(size_t channels, size_t stepSize, size_t blockSize)
 	m_chromagram = 0;
     }
 
+    delete m_batch;
+    m_batch = 0;
+
     if (channels < getMinChannelCount() ||
 	channels > getMaxChannelCount()) return false;
 
@@ -245,6 +273,22 @@ ChromagramPlugin::initialise(size_t channels, size_t stepSize, size_t blockSize)
         std::cerr << "ChromagramPlugin::initialise: NOTE: supplied step size " << stepSize << " differs from expected step size " << m_step << " (for block size = " << m_block << ")" << std::endl;
     }
 
+    m_stepSize = stepSize;
+
+    if (m_batchSize > 1) {
+        // The same constant-Q configuration as Chromagram uses,
+        // which extends the range up to a whole number of octaves
+        double octaves = log(m_config.max / m_config.min) / log(2.0);
+        CQConfig config;
+        config.FS = m_config.FS;
+        config.min = m_config.min;
+        config.max = m_config.min * pow(2.0, ceil(octaves));
+        config.BPO = m_config.BPO;
+        config.CQThresh = m_config.CQThresh;
+        m_batch = new BatchConstantQ(config, m_batchSize);
+        m_timestamps.clear();
+    }
+
     return true;
 }
 
@@ -259,6 +303,10 @@ ChromagramPlugin::reset()
         }
         m_count = 0;
     }
+    if (m_batch) {
+        m_batch->clear();
+        m_timestamps.clear();
+    }
 }
 
 size_t
@@ -321,6 +369,13 @@ ChromagramPlugin::getOutputDescriptors() const
     d.maxValue = (d.hasKnownExtents ? 1.0 : 0.0);
     d.isQuantized = false;
     d.sampleType = OutputDescriptor::OneSamplePerStep;
+    if (m_batchSize > 1) {
+        // Features are returned a batch at a time, with timestamps,
+        // one per step of the input
+        size_t step = (m_stepSize ? m_stepSize : getPreferredStepSize());
+        d.sampleType = OutputDescriptor::FixedSampleRate;
+        d.sampleRate = m_inputSampleRate / step;
+    }
     list.push_back(d);
 
     d.identifier = "chromameans";
@@ -335,7 +390,7 @@ ChromagramPlugin::getOutputDescriptors() const
 
 ChromagramPlugin::FeatureSet
 ChromagramPlugin::process(const float *const *inputBuffers,
-                          Vamp::RealTime )
+                          Vamp::RealTime timestamp)
 {
     if (!m_chromagram) {
 	cerr << "ERROR: ChromagramPlugin::process: "
@@ -344,6 +399,15 @@ ChromagramPlugin::process(const float *const *inputBuffers,
 	return FeatureSet();
     }
 
+    if (m_batch) {
+        m_batch->addFrame(inputBuffers[0]);
+        m_timestamps.push_back(timestamp);
+        if (m_batch->getFrameCount() < m_batch->getBatchSize()) {
+            return FeatureSet();
+        }
+        return processBatch();
+    }
+
     double *real = new double[m_block];
     double *imag = new double[m_block];
 
@@ -403,6 +467,12 @@ ChromagramPlugin::process(const float *const *inputBuffers,
 ChromagramPlugin::FeatureSet
 ChromagramPlugin::getRemainingFeatures()
 {
+    FeatureSet returnFeatures;
+
+    if (m_batch && m_batch->getFrameCount() > 0) {
+        returnFeatures = processBatch();
+    }
+
     Feature feature;
     feature.hasTimestamp = true;
     feature.timestamp = Vamp::RealTime::zeroTime;
@@ -414,8 +484,61 @@ ChromagramPlugin::getRemainingFeatures()
     }
     feature.label = "Chromagram bin means";
 
-    FeatureSet returnFeatures;
     returnFeatures[1].push_back(feature);
     return returnFeatures;
 }
 
+ChromagramPlugin::FeatureSet
+ChromagramPlugin::processBatch()
+{
+    // As Chromagram::process, but with the constant-Q transform done
+    // for the whole batch at once
+
+    FeatureSet returnFeatures;
+
+    int frames = m_batch->getFrameCount();
+    int stride = m_batch->getBatchSize();
+    int bpo = m_config.BPO;
+    int octaves = m_batch->getBinCount() / bpo;
+
+    m_batch->process();
+
+    const double *cqre = m_batch->getReal();
+    const double *cqim = m_batch->getImag();
+
+    vector<double> chroma(bpo);
+
+    for (int f = 0; f < frames; ++f) {
+
+        for (int i = 0; i < bpo; ++i) {
+            chroma[i] = 0.0;
+        }
+        for (int octave = 0; octave < octaves; ++octave) {
+            for (int i = 0; i < bpo; ++i) {
+                int index = (octave * bpo + i) * stride + f;
+                double re = cqre[index];
+                double im = cqim[index];
+                chroma[i] += sqrt(re * re + im * im);
+            }
+        }
+        MathUtilities::normalise(&chroma[0], bpo, m_normalise);
+
+        Feature feature;
+        feature.hasTimestamp = true;
+        feature.timestamp = m_timestamps[f];
+        for (int i = 0; i < bpo; ++i) {
+            double value = chroma[i];
+            if (ISNAN(value)) value = 0.0;
+            m_binsums[i] += value;
+            feature.values.push_back(value);
+        }
+        feature.label = "";
+        ++m_count;
+
+        returnFeatures[0].push_back(feature);
+    }
+
+    m_timestamps.clear();
+    return returnFeatures;
+}
+
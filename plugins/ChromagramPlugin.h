@@ -18,6 +18,10 @@
 #include <vamp-sdk/Plugin.h>
 #include <dsp/chromagram/Chromagram.h>
 
+#include <vector>
+
+class BatchConstantQ;
+
 class ChromagramPlugin : public Vamp::Plugin
 {
 public:
@@ -56,14 +60,25 @@ protected:
     float m_tuningFrequency;
     MathUtilities::NormaliseType m_normalise;
     int m_bpo;
+    int m_batchSize;
 
     void setupConfig();
 
     ChromaConfig m_config;
     Chromagram *m_chromagram;
+
+    // Used in place of m_chromagram's own constant-Q transform when
+    // m_batchSize > 1, with the timestamps of the frames waiting in it
+    BatchConstantQ *m_batch;
+    std::vector<Vamp::RealTime> m_timestamps;
+    FeatureSet processBatch();
+
     mutable size_t m_step;
     mutable size_t m_block;
 
+    // The step size given to initialise, or 0 if not initialised
+    size_t m_stepSize;
+
     std::vector<double> m_binsums;
     size_t m_count;
 };
@@ -13,6 +13,7 @@
 */
 
 #include "ConstantQSpectrogram.h"
+#include "BatchConstantQ.h"
 
 #include <base/Pitch.h>
 #include <dsp/chromagram/ConstantQ.h>
@@ -26,14 +27,17 @@ ConstantQSpectrogram::ConstantQSpectrogram(float inputSampleRate) :
     Vamp::Plugin(inputSampleRate),
     m_bins(1),
     m_cq(0),
+    m_batch(0),
     m_step(0),
-    m_block(0)
+    m_block(0),
+    m_stepSize(0)
 {
     m_minMIDIPitch = 36;
     m_maxMIDIPitch = 84;
     m_tuningFrequency = 440;
     m_normalized = false;
     m_bpo = 12;
+    m_batchSize = 1;
 
     setupConfig();
 }
@@ -56,6 +60,7 @@ ConstantQSpectrogram::setupConfig()
 ConstantQSpectrogram::~ConstantQSpectrogram()
 {
     delete m_cq;
+    delete m_batch;
 }
 
 string
@@ -154,6 +159,17 @@ ConstantQSpectrogram::getParameterDescriptors() const
     desc.quantizeStep = 1;
     list.push_back(desc);
 
+    desc.identifier = "batch";
+    desc.name = "Frames per Batch";
+    desc.unit = "frames";
+    desc.description = "Number of process blocks to gather and transform together.  More than one is faster, but delays the output until a batch is complete";
+    desc.minValue = 1;
+    desc.maxValue = 64;
+    desc.defaultValue = 1;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    list.push_back(desc);
+
     return list;
 }
 
@@ -175,6 +191,9 @@ ConstantQSpectrogram::getParameter(std::string param) const
     if (param == "normalized") {
         return m_normalized;
     }
+    if (param == "batch") {
+        return m_batchSize;
+    }
     std::cerr << "WARNING: ConstantQSpectrogram::getParameter: unknown parameter \""
               << param << "\"" << std::endl;
     return 0.0;
@@ -193,6 +212,9 @@ ConstantQSpectrogram::setParameter(std::string param, float value)
         m_bpo = lrintf(value);
     } else if (param == "normalized") {
         m_normalized = (value > 0.0001);
+    } else if (param == "batch") {
+        m_batchSize = lrintf(value);
+        if (m_batchSize < 1) m_batchSize = 1;
     } else {
         std::cerr << "WARNING: ConstantQSpectrogram::setParameter: unknown parameter \""
                   << param << "\"" << std::endl;
@@ -210,6 +232,9 @@ ConstantQSpectrogram::initialise(size_t channels, size_t stepSize, size_t blockS
 	m_cq = 0;
     }
 
+    delete m_batch;
+    m_batch = 0;
+
     if (channels < getMinChannelCount() ||
 	channels > getMaxChannelCount()) return false;
 
@@ -237,6 +262,13 @@ ConstantQSpectrogram::initialise(size_t channels, size_t stepSize, size_t blockS
         std::cerr << "ConstantQSpectrogram::initialise: NOTE: supplied step size " << stepSize << " differs from expected step size " << m_step << " (for block size = " << m_block << ")" << std::endl;
     }
 
+    m_stepSize = stepSize;
+
+    if (m_batchSize > 1) {
+        m_batch = new BatchConstantQ(m_config, m_batchSize);
+        m_timestamps.clear();
+    }
+
     return true;
 }
 
@@ -251,6 +283,10 @@ ConstantQSpectrogram::reset()
         m_step = m_cq->getHop();
         m_block = m_cq->getFFTLength();
     }
+    if (m_batch) {
+        m_batch->clear();
+        m_timestamps.clear();
+    }
 }
 
 size_t
@@ -310,6 +346,13 @@ ConstantQSpectrogram::getOutputDescriptors() const
     d.maxValue = (m_normalized ? 1.0 : 0.0);
     d.isQuantized = false;
     d.sampleType = OutputDescriptor::OneSamplePerStep;
+    if (m_batchSize > 1) {
+        // Features are returned a batch at a time, with timestamps,
+        // one per step of the input
+        size_t step = (m_stepSize ? m_stepSize : getPreferredStepSize());
+        d.sampleType = OutputDescriptor::FixedSampleRate;
+        d.sampleRate = m_inputSampleRate / step;
+    }
     list.push_back(d);
 
     return list;
@@ -339,7 +382,7 @@ ConstantQSpectrogram::normalize(const Feature &feature)
 
 ConstantQSpectrogram::FeatureSet
 ConstantQSpectrogram::process(const float *const *inputBuffers,
-                              Vamp::RealTime /* timestamp */)
+                              Vamp::RealTime timestamp)
 {
     if (!m_cq) {
 	cerr << "ERROR: ConstantQSpectrogram::process: "
@@ -348,6 +391,15 @@ ConstantQSpectrogram::process(const float *const *inputBuffers,
 	return FeatureSet();
     }
 
+    if (m_batch) {
+        m_batch->addFrame(inputBuffers[0]);
+        m_timestamps.push_back(timestamp);
+        if (m_batch->getFrameCount() < m_batch->getBatchSize()) {
+            return FeatureSet();
+        }
+        return processBatch();
+    }
+
     double *real = new double[m_block];
     double *imag = new double[m_block];
     double *cqre = new double[m_bins];
@@ -394,6 +446,46 @@ ConstantQSpectrogram::process(const float *const *inputBuffers,
 ConstantQSpectrogram::FeatureSet
 ConstantQSpectrogram::getRemainingFeatures()
 {
+    if (m_batch && m_batch->getFrameCount() > 0) {
+        return processBatch();
+    }
     return FeatureSet();
 }
 
+ConstantQSpectrogram::FeatureSet
+ConstantQSpectrogram::processBatch()
+{
+    FeatureSet returnFeatures;
+
+    int frames = m_batch->getFrameCount();
+    int stride = m_batch->getBatchSize();
+
+    m_batch->process();
+
+    const double *cqre = m_batch->getReal();
+    const double *cqim = m_batch->getImag();
+
+    for (int f = 0; f < frames; ++f) {
+
+        Feature feature;
+        for (int i = 0; i < m_bins; ++i) {
+            double re = cqre[i * stride + f];
+            double im = cqim[i * stride + f];
+            if (ISNAN(re)) re = 0.0;
+            if (ISNAN(im)) im = 0.0;
+            double value = sqrt(re * re + im * im);
+            feature.values.push_back(value);
+        }
+        feature.label = "";
+
+        if (m_normalized) feature = normalize(feature);
+        feature.hasTimestamp = true;
+        feature.timestamp = m_timestamps[f];
+
+        returnFeatures[0].push_back(feature);
+    }
+
+    m_timestamps.clear();
+    return returnFeatures;
+}
+
@@ -19,6 +19,9 @@
 #include <dsp/chromagram/ConstantQ.h>
 
 #include <queue>
+#include <vector>
+
+class BatchConstantQ;
 
 class ConstantQSpectrogram : public Vamp::Plugin
 {
@@ -59,14 +62,25 @@ protected:
     bool m_normalized;
     int m_bpo;
     int m_bins;
+    int m_batchSize;
 
     void setupConfig();
 
     CQConfig m_config;
     ConstantQ *m_cq;
+
+    // Used in place of m_cq when m_batchSize > 1, with the
+    // timestamps of the frames waiting in it
+    BatchConstantQ *m_batch;
+    std::vector<Vamp::RealTime> m_timestamps;
+    FeatureSet processBatch();
+
     mutable size_t m_step;
     mutable size_t m_block;
 
+    // The step size given to initialise, or 0 if not initialised
+    size_t m_stepSize;
+
     Feature normalize(const Feature &);
 };
 
@@ -0,0 +1,83 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    QM Vamp Plugin Set
+
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _DEINTERLEAVE_H_
+#define _DEINTERLEAVE_H_
+
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DEINTERLEAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/**
+ * Split a frequency-domain input buffer as supplied by the Vamp host
+ * (interleaved real and imaginary float values) into separate arrays
+ * of double-precision reals and imaginaries, as taken by
+ * DetectionFunction::processFrequencyDomain.
+ *
+ * The arrays are allocated once, for a given number of bins, and
+ * reused for every call to deinterleave.  They are aligned to a
+ * 16-byte boundary so that the conversion can be vectorised.
+ */
+class DeinterleavedSpectrum
+{
+public:
+    DeinterleavedSpectrum(int bins) :
+        m_bins(bins) {
+        // Round each array up to an even length so the imaginaries
+        // start at the same alignment as the reals
+        int stride = bins + (bins & 1);
+        m_block = new double[2 * stride + 1];
+        reals = (double *)(((uintptr_t)m_block + 15) & ~(uintptr_t)15);
+        imags = reals + stride;
+    }
+
+    ~DeinterleavedSpectrum() {
+        delete[] m_block;
+    }
+
+    int getBinCount() const { return m_bins; }
+
+    void deinterleave(const float *in) {
+        int i = 0;
+#ifdef DEINTERLEAVE_SSE2
+        for (; i + 2 <= m_bins; i += 2) {
+            // re0 im0 re1 im1
+            __m128 v = _mm_loadu_ps(in + i*2);
+            __m128d a = _mm_cvtps_pd(v);
+            __m128d b = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+            _mm_store_pd(reals + i, _mm_unpacklo_pd(a, b));
+            _mm_store_pd(imags + i, _mm_unpackhi_pd(a, b));
+        }
+#endif
+        for (; i < m_bins; ++i) {
+            reals[i] = in[i*2];
+            imags[i] = in[i*2+1];
+        }
+    }
+
+    double *reals;
+    double *imags;
+
+private:
+    DeinterleavedSpectrum(const DeinterleavedSpectrum &); // not provided
+    DeinterleavedSpectrum &operator=(const DeinterleavedSpectrum &); // not provided
+
+    int m_bins;
+    double *m_block;
+};
+
+#endif
@@ -13,11 +13,16 @@
 */
 
 #include "OnsetDetect.h"
+#include "SharedDetectionFunction.h"
+#include "Deinterleave.h"
 
 #include <dsp/onsets/DetectionFunction.h>
 #include <dsp/onsets/PeakPicking.h>
 #include <dsp/tempotracking/TempoTrack.h>
 
+#include <algorithm>
+#include <cmath>
+
 using std::string;
 using std::vector;
 using std::cerr;
@@ -25,35 +30,82 @@ using std::endl;
 
 float OnsetDetector::m_preferredStepSecs = 0.01161;
 
+// In online mode, the peak picker is re-run every OnlineInterval
+// seconds over the most recent OnlineHistory seconds of detection
+// function plus the look-ahead
+static const float OnlineHistory = 10.f;
+static const float OnlineInterval = 0.25f;
+
+// The peak picker normalises its input by this alpha norm
+static const int PeakPickAlpha = 9;
+
 class OnsetDetectorData
 {
 public:
-    OnsetDetectorData(const DFConfig &config) : dfConfig(config) {
-	df = new DetectionFunction(config);
+    OnsetDetectorData(const DFConfig &config, int functions) :
+        dfConfig(config), spectrum(config.frameLength / 2 + 1) {
+        for (int c = 0; c < functions; ++c) {
+            df.push_back(new SharedDetectionFunction(config));
+        }
+        dfBase = 0;
+        nextUpdate = 0;
+        reported = 0;
+        lastOnset = -1;
+        normed = 0;
+        alphaSum = 0.0;
     }
     ~OnsetDetectorData() {
-	delete df;
+        for (size_t c = 0; c < df.size(); ++c) delete df[c];
     }
     void reset() {
-	delete df;
-	df = new DetectionFunction(dfConfig);
+        for (size_t c = 0; c < df.size(); ++c) {
+            delete df[c];
+            df[c] = new SharedDetectionFunction(dfConfig);
+        }
 	dfOutput.clear();
         origin = Vamp::RealTime::zeroTime;
+        dfBase = 0;
+        nextUpdate = 0;
+        reported = 0;
+        lastOnset = -1;
+        normed = 0;
+        alphaSum = 0.0;
     }
 
     DFConfig dfConfig;
-    DetectionFunction *df;
-    vector<double> dfOutput;
+    vector<SharedDetectionFunction *> df; // one, or one per channel
+    DeinterleavedSpectrum spectrum;
+    vector<double> dfOutput; // summed across df
     Vamp::RealTime origin;
+
+    // Online mode only.  dfOutput holds the detection function from
+    // frame dfBase onwards; earlier frames have been discarded.
+    // Onsets and smoothed detection function before frame reported
+    // have been returned, the last onset at frame lastOnset, and the
+    // peak picker is next due to run at frame nextUpdate.  alphaSum
+    // is the sum of the peak picker's input values, each raised to
+    // the power PeakPickAlpha, for the frames before frame normed.
+    int dfBase;
+    int nextUpdate;
+    int reported;
+    int lastOnset;
+    int normed;
+    double alphaSum;
 };
     
 
 OnsetDetector::OnsetDetector(float inputSampleRate) :
     Vamp::Plugin(inputSampleRate),
     m_d(0),
+    m_channels(0),
     m_dfType(DF_COMPLEXSD),
     m_sensitivity(50),
-    m_whiten(false)
+    m_whiten(false),
+    m_online(false),
+    m_lookahead(1.f),
+    m_compact(false),
+    m_sweepStep(0),
+    m_perChannel(false)
 {
 }
 
@@ -62,6 +114,20 @@ OnsetDetector::~OnsetDetector()
     delete m_d;
 }
 
+size_t
+OnsetDetector::getMinChannelCount() const
+{
+    return 1;
+}
+
+size_t
+OnsetDetector::getMaxChannelCount() const
+{
+    // Unless detecting per channel, let the host mix the input down
+    // to one channel, as it does for the other plugins
+    return m_perChannel ? 64 : 1;
+}
+
 string
 OnsetDetector::getIdentifier() const
 {
@@ -142,6 +208,60 @@ OnsetDetector::getParameterDescriptors() const
     desc.unit = "";
     list.push_back(desc);
 
+    desc.identifier = "online";
+    desc.name = "Online Detection";
+    desc.description = "Report onsets as the input is processed, after a fixed look-ahead, rather than at the end";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = 0;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "";
+    list.push_back(desc);
+
+    desc.identifier = "lookahead";
+    desc.name = "Online Look-ahead";
+    desc.description = "In online detection, how far ahead of an onset the input must have been processed before the onset is reported";
+    desc.minValue = 0.2;
+    desc.maxValue = 5;
+    desc.defaultValue = 1;
+    desc.isQuantized = false;
+    desc.unit = "s";
+    list.push_back(desc);
+
+    desc.identifier = "compact";
+    desc.name = "Compact Output";
+    desc.description = "Return the smoothed detection function as the values of a single feature, timestamped at its first frame, rather than one feature per frame";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = 0;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "";
+    list.push_back(desc);
+
+    desc.identifier = "sweepstep";
+    desc.name = "Sensitivity Sweep Step";
+    desc.description = "If non-zero, also find onsets at every multiple of this sensitivity from 0 to 100%, from the same detection function, and return them on the sensitivity sweep output (offline detection only, and not with the broadband energy rise)";
+    desc.minValue = 0;
+    desc.maxValue = 50;
+    desc.defaultValue = 0;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "%";
+    list.push_back(desc);
+
+    desc.identifier = "perchannel";
+    desc.name = "Per-Channel Detection";
+    desc.description = "Accept more than one input channel, calculating a detection function for each channel and picking onsets from their sum, rather than having the host mix the channels down";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = 0;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "";
+    list.push_back(desc);
+
     return list;
 }
 
@@ -160,6 +280,16 @@ OnsetDetector::getParameter(std::string name) const
         return m_sensitivity;
     } else if (name == "whiten") {
         return m_whiten ? 1.0 : 0.0; 
+    } else if (name == "online") {
+        return m_online ? 1.0 : 0.0;
+    } else if (name == "lookahead") {
+        return m_lookahead;
+    } else if (name == "compact") {
+        return m_compact ? 1.0 : 0.0;
+    } else if (name == "sweepstep") {
+        return m_sweepStep;
+    } else if (name == "perchannel") {
+        return m_perChannel ? 1.0 : 0.0;
     }
     return 0.0;
 }
@@ -187,6 +317,16 @@ OnsetDetector::setParameter(std::string name, float value)
         if (m_whiten == (value > 0.5)) return;
         m_whiten = (value > 0.5);
         m_program = "";
+    } else if (name == "online") {
+        m_online = (value > 0.5);
+    } else if (name == "lookahead") {
+        m_lookahead = value;
+    } else if (name == "compact") {
+        m_compact = (value > 0.5);
+    } else if (name == "sweepstep") {
+        m_sweepStep = lrintf(value);
+    } else if (name == "perchannel") {
+        m_perChannel = (value > 0.5);
     }
 }
 
@@ -263,7 +403,8 @@ OnsetDetector::initialise(size_t channels, size_t stepSize, size_t blockSize)
     dfConfig.whiteningRelaxCoeff = -1;
     dfConfig.whiteningFloor = -1;
     
-    m_d = new OnsetDetectorData(dfConfig);
+    m_channels = channels;
+    m_d = new OnsetDetectorData(dfConfig, channels);
     return true;
 }
 
@@ -326,6 +467,13 @@ OnsetDetector::getOutputDescriptors() const
     sdf.binCount = 1;
     sdf.hasKnownExtents = false;
     sdf.isQuantized = false;
+    if (m_compact) {
+        sdf.description = "Smoothed probability function used for peak-picking, as the values of a single feature per block of frames";
+        sdf.hasFixedBinCount = false;
+    }
+    if (m_online) {
+        sdf.description += " (in online detection, normalised over the detection function so far rather than the whole input)";
+    }
 
     sdf.sampleType = OutputDescriptor::VariableSampleRate;
 
@@ -333,9 +481,36 @@ OnsetDetector::getOutputDescriptors() const
 //    sdf.sampleType = OutputDescriptor::FixedSampleRate;
     sdf.sampleRate = 1.0 / stepSecs;
 
+    OutputDescriptor cdf;
+    cdf.identifier = "channel_detection_fns";
+    cdf.name = "Per-Channel Onset Detection Functions";
+    cdf.description = "Probability function of note onset likelihood for each input channel, of which the onset detection function is the sum (per-channel detection with more than one channel only)";
+    cdf.unit = "";
+    cdf.hasFixedBinCount = true;
+    cdf.binCount = m_channels;
+    cdf.hasKnownExtents = false;
+    cdf.isQuantized = false;
+    cdf.sampleType = OutputDescriptor::OneSamplePerStep;
+
+    OutputDescriptor sweep;
+    sweep.identifier = "sweep_onsets";
+    sweep.name = "Sensitivity Sweep Onsets";
+    sweep.description = "Note onset positions found at each sensitivity in the sweep, with the sensitivity as value (empty for the broadband energy rise)";
+    sweep.unit = "%";
+    sweep.hasFixedBinCount = true;
+    sweep.binCount = 1;
+    sweep.hasKnownExtents = true;
+    sweep.minValue = 0;
+    sweep.maxValue = 100;
+    sweep.isQuantized = false;
+    sweep.sampleType = OutputDescriptor::VariableSampleRate;
+    sweep.sampleRate = 1.0 / stepSecs;
+
     list.push_back(onsets);
     list.push_back(df);
     list.push_back(sdf);
+    list.push_back(cdf);
+    list.push_back(sweep);
 
     return list;
 }
@@ -351,8 +526,6 @@ OnsetDetector::process(const float *const *inputBuffers,
 	return FeatureSet();
     }
 
-    size_t len = m_d->dfConfig.frameLength / 2 + 1;
-
 //    float mean = 0.f;
 //    for (size_t i = 0; i < len; ++i) {
 ////        std::cerr << inputBuffers[0][i] << " ";
@@ -365,20 +538,35 @@ OnsetDetector::process(const float *const *inputBuffers,
 //              << "dftype " << m_dfType << ", sens " << m_sensitivity
 //              << ", len " << len << ", mean " << mean << std::endl;
 
-    double *reals = new double[len];
-    double *imags = new double[len];
+    // There is more than one channel only in per-channel detection.
+    // Each channel then has its own detection function, and the
+    // onsets are picked from the sum of them.  All channels share the
+    // one deinterleaving buffer, as its contents are only needed
+    // until the channel's detection function has been calculated.
 
-    // We only support a single input channel
+    Feature channels;
+    channels.hasTimestamp = false;
 
-    for (size_t i = 0; i < len; ++i) {
-        reals[i] = inputBuffers[0][i*2];
-        imags[i] = inputBuffers[0][i*2+1];
-    }
+    double output = 0.0;
 
-    double output = m_d->df->processFrequencyDomain(reals, imags);
+    if (m_channels == 1) {
 
-    delete[] reals;
-    delete[] imags;
+        m_d->spectrum.deinterleave(inputBuffers[0]);
+        output = m_d->df[0]->processFrequencyDomain
+            (m_d->spectrum.reals, m_d->spectrum.imags);
+
+    } else {
+
+        channels.values.reserve(m_channels);
+
+        for (int c = 0; c < m_channels; ++c) {
+            m_d->spectrum.deinterleave(inputBuffers[c]);
+            double value = m_d->df[c]->processFrequencyDomain
+                (m_d->spectrum.reals, m_d->spectrum.imags);
+            channels.values.push_back(value);
+            output += value;
+        }
+    }
 
     if (m_d->dfOutput.empty()) m_d->origin = timestamp;
 
@@ -386,6 +574,10 @@ OnsetDetector::process(const float *const *inputBuffers,
 
     FeatureSet returnFeatures;
 
+    if (m_online) {
+        returnFeatures = detectOnline(false);
+    }
+
     Feature feature;
     feature.hasTimestamp = false;
     feature.values.push_back(output);
@@ -393,6 +585,9 @@ OnsetDetector::process(const float *const *inputBuffers,
 //    std::cerr << "df: " << output << std::endl;
 
     returnFeatures[1].push_back(feature); // detection function is output 1
+    if (!channels.values.empty()) {
+        returnFeatures[3].push_back(channels); // per-channel functions are output 3
+    }
     return returnFeatures;
 }
 
@@ -406,84 +601,296 @@ OnsetDetector::getRemainingFeatures()
 	return FeatureSet();
     }
 
+    if (m_online) return detectOnline(true);
+
+    FeatureSet returnFeatures;
+
+    int length = m_d->dfOutput.size();
+
+    double *ppSrc = new double[length];
+    for (int i = 0; i < length; ++i) {
+        ppSrc[i] = m_d->dfOutput[i];
+    }
+
+    vector<int> onsets;
+    pickPeaks(ppSrc, length, onsets, m_sensitivity);
+
+    for (size_t i = 0; i < onsets.size(); ++i) {
+
+        size_t index = findOnset(ppSrc, onsets[i]);
+
+	size_t frame = index * m_d->dfConfig.stepSize;
+
+	Feature feature;
+	feature.hasTimestamp = true;
+	feature.timestamp = m_d->origin + Vamp::RealTime::frame2RealTime
+	    (frame, lrintf(m_inputSampleRate));
+
+	returnFeatures[0].push_back(feature); // onsets are output 0
+    }
+
+    addSmoothed(returnFeatures, ppSrc, 0, length);
+
+    // The sensitivity only affects the peak picker, so onsets for the
+    // whole sweep can be found from the one detection function.  The
+    // exception is the broadband energy rise, whose detection
+    // function depends on the sensitivity set at initialisation: a
+    // sweep of it would not give the onsets of a run at each
+    // sensitivity, so none is made.
+
+    bool sweep = (m_sweepStep > 0 && m_dfType != DF_BROADBAND);
+
+    for (int s = 0; sweep && s <= 100; s += m_sweepStep) {
+
+        for (int i = 0; i < length; ++i) {
+            ppSrc[i] = m_d->dfOutput[i];
+        }
+
+        onsets.clear();
+        pickPeaks(ppSrc, length, onsets, s);
+
+        for (size_t i = 0; i < onsets.size(); ++i) {
+
+            size_t index = findOnset(ppSrc, onsets[i]);
+            size_t frame = index * m_d->dfConfig.stepSize;
+
+            Feature feature;
+            feature.hasTimestamp = true;
+            feature.timestamp = m_d->origin + Vamp::RealTime::frame2RealTime
+                (frame, lrintf(m_inputSampleRate));
+            feature.values.push_back(s);
+
+            returnFeatures[4].push_back(feature); // sweep onsets are output 4
+        }
+    }
+
+    delete[] ppSrc;
+
+    return returnFeatures;
+}
+
+double
+OnsetDetector::threshold(double value, float sensitivity) const
+{
+    // The broadband energy rise counts bins, so its threshold scales
+    // with the number of detection functions summed.  Other types are
+    // not thresholded.
+
+    if (m_dfType != DF_BROADBAND) return value;
+
+    int functions = m_d->df.size();
+    if (value < ((110 - sensitivity) *
+                 m_d->dfConfig.frameLength * functions) / 200) {
+        return 0.0;
+    }
+    return value;
+}
+
+void
+OnsetDetector::pickPeaks(double *df, int length, vector<int> &peaks,
+                         float sensitivity) const
+{
+    // Threshold and peak-pick the given detection function with the
+    // given sensitivity, leaving the smoothed function used for
+    // peak-picking in df
+
     if (m_dfType == DF_BROADBAND) {
-        for (size_t i = 0; i < m_d->dfOutput.size(); ++i) {
-            if (m_d->dfOutput[i] < ((110 - m_sensitivity) *
-                                    m_d->dfConfig.frameLength) / 200) {
-                m_d->dfOutput[i] = 0;
-            }
+        for (int i = 0; i < length; ++i) {
+            df[i] = threshold(df[i], sensitivity);
         }
     }
 
     double aCoeffs[] = { 1.0000, -0.5949, 0.2348 };
     double bCoeffs[] = { 0.1600,  0.3200, 0.1600 };
 
-    FeatureSet returnFeatures;
-
     PPickParams ppParams;
-    ppParams.length = m_d->dfOutput.size();
+    ppParams.length = length;
     // tau and cutoff appear to be unused in PeakPicking, but I've
     // inserted some moderately plausible values rather than leave
     // them unset.  The QuadThresh values come from trial and error.
     // The rest of these are copied from ttParams in the BeatTracker
     // code: I don't claim to know whether they're good or not --cc
     ppParams.tau = m_d->dfConfig.stepSize / m_inputSampleRate;
-    ppParams.alpha = 9;
+    ppParams.alpha = PeakPickAlpha;
     ppParams.cutoff = m_inputSampleRate/4;
     ppParams.LPOrd = 2;
     ppParams.LPACoeffs = aCoeffs;
     ppParams.LPBCoeffs = bCoeffs;
     ppParams.WinT.post = 8;
     ppParams.WinT.pre = 7;
-    ppParams.QuadThresh.a = (100 - m_sensitivity) / 1000.0;
+    ppParams.QuadThresh.a = (100 - sensitivity) / 1000.0;
     ppParams.QuadThresh.b = 0;
-    ppParams.QuadThresh.c = (100 - m_sensitivity) / 1500.0;
+    ppParams.QuadThresh.c = (100 - sensitivity) / 1500.0;
 
     PeakPicking peakPicker(ppParams);
+    peakPicker.process(df, length, peaks);
+}
 
-    double *ppSrc = new double[ppParams.length];
-    for (int i = 0; i < ppParams.length; ++i) {
-        ppSrc[i] = m_d->dfOutput[i];
+int
+OnsetDetector::findOnset(const double *smoothed, int peak) const
+{
+    // Except for the broadband energy rise, where the peak is itself
+    // the onset, walk back from the peak to the start of its rise
+
+    int index = peak;
+
+    if (m_dfType != DF_BROADBAND) {
+        double prevDiff = 0.0;
+        while (index > 1) {
+            double diff = smoothed[index] - smoothed[index-1];
+            if (diff < prevDiff * 0.9) break;
+            prevDiff = diff;
+            --index;
+        }
     }
 
-    vector<int> onsets;
-    peakPicker.process(ppSrc, ppParams.length, onsets);
+    return index;
+}
 
-    for (size_t i = 0; i < onsets.size(); ++i) {
+void
+OnsetDetector::addSmoothed(FeatureSet &features, const double *smoothed,
+                           int from, int to) const
+{
+    // Add the smoothed detection function for frames from to to
+    // (exclusive), of which smoothed holds the values starting at
+    // from, either one feature per frame or all in one
 
-        size_t index = onsets[i];
+    if (to <= from) return;
 
-        if (m_dfType != DF_BROADBAND) {
-            double prevDiff = 0.0;
-            while (index > 1) {
-                double diff = ppSrc[index] - ppSrc[index-1];
-                if (diff < prevDiff * 0.9) break;
-                prevDiff = diff;
-                --index;
-            }
-        }
+    size_t step = m_d->dfConfig.stepSize;
+    int rate = lrintf(m_inputSampleRate);
 
-	size_t frame = index * m_d->dfConfig.stepSize;
+    if (m_compact) {
 
-	Feature feature;
-	feature.hasTimestamp = true;
-	feature.timestamp = m_d->origin + Vamp::RealTime::frame2RealTime
-	    (frame, lrintf(m_inputSampleRate));
+        Feature feature;
+        feature.hasTimestamp = true;
+        feature.timestamp = m_d->origin + Vamp::RealTime::frame2RealTime
+            (from * step, rate);
+        feature.values.assign(smoothed, smoothed + (to - from));
 
-	returnFeatures[0].push_back(feature); // onsets are output 0
+        features[2].push_back(feature); // smoothed df is output 2
+        return;
     }
 
-    for (int i = 0; i < ppParams.length; ++i) {
+    for (int i = from; i < to; ++i) {
         
         Feature feature;
 
         feature.hasTimestamp = true;
-	size_t frame = i * m_d->dfConfig.stepSize;
+	size_t frame = i * step;
+	feature.timestamp = m_d->origin + Vamp::RealTime::frame2RealTime
+	    (frame, rate);
+
+        feature.values.push_back(smoothed[i - from]);
+        features[2].push_back(feature); // smoothed df is output 2
+    }
+}
+
+OnsetDetector::FeatureSet
+OnsetDetector::detectOnline(bool final)
+{
+    // Run the peak picker over a window consisting of the most recent
+    // OnlineHistory seconds of detection function plus the
+    // look-ahead, and report the onsets found in it whose peaks fall
+    // before the look-ahead and after what has already been
+    // reported, together with the smoothed detection function over
+    // the same range.  Frame numbers here are indices into the whole
+    // detection function.  The peak picker normalises over the
+    // window rather than the whole input, so onsets may differ
+    // slightly from those of the offline peak picker.  The smoothed
+    // detection function is rescaled to the normalisation of the
+    // whole detection function so far, so that it does not change
+    // in scale from one window to the next.
+
+    FeatureSet returnFeatures;
+
+    size_t step = m_d->dfConfig.stepSize;
+    float frameRate = m_inputSampleRate / step;
+
+    int lookahead = int(m_lookahead * frameRate + 0.5);
+    int history = int(OnlineHistory * frameRate + 0.5);
+    int end = m_d->dfBase + int(m_d->dfOutput.size());
+
+    for (int i = m_d->normed; i < end; ++i) {
+        double value = threshold(m_d->dfOutput[i - m_d->dfBase],
+                                 m_sensitivity);
+        m_d->alphaSum += pow(fabs(value), PeakPickAlpha);
+    }
+    m_d->normed = end;
+
+    if (!final) {
+        if (end < m_d->nextUpdate) return returnFeatures;
+        m_d->nextUpdate = end + int(OnlineInterval * frameRate + 0.5);
+    }
+
+    int from = end - history - lookahead;
+    if (from < m_d->dfBase) from = m_d->dfBase;
+
+    int limit = (final ? end : end - lookahead);
+    if (limit <= m_d->reported || end <= from) return returnFeatures;
+
+    vector<double> smoothed(m_d->dfOutput.begin() + (from - m_d->dfBase),
+                            m_d->dfOutput.begin() + (end - m_d->dfBase));
+
+    // The peak picker divides its input by the alpha norm of the
+    // window, and the smoothing is otherwise linear apart from the
+    // offset it removes, so the ratio of the window's norm to that of
+    // the whole detection function rescales its output to the latter
+
+    double windowSum = 0.0;
+    for (int i = 0; i < end - from; ++i) {
+        windowSum += pow(fabs(threshold(smoothed[i], m_sensitivity)),
+                         PeakPickAlpha);
+    }
+    double scale = 1.0;
+    if (windowSum > 0.0 && m_d->alphaSum > 0.0) {
+        scale = pow((windowSum / (end - from)) / (m_d->alphaSum / end),
+                    1.0 / PeakPickAlpha);
+    }
+
+    vector<int> peaks;
+    pickPeaks(&smoothed[0], end - from, peaks, m_sensitivity);
+
+    for (size_t i = 0; i < peaks.size(); ++i) {
+
+        int peak = from + peaks[i];
+        if (peak < m_d->reported) continue;
+        if (peak >= limit) break;
+
+        // A peak reported from an earlier window may have moved by a
+        // frame or so in this one, but will still lead back to the
+        // same onset
+        int index = from + findOnset(&smoothed[0], peaks[i]);
+        if (index <= m_d->lastOnset) continue;
+
+        m_d->lastOnset = index;
+
+	size_t frame = index * step;
+
+	Feature feature;
+	feature.hasTimestamp = true;
 	feature.timestamp = m_d->origin + Vamp::RealTime::frame2RealTime
 	    (frame, lrintf(m_inputSampleRate));
 
-        feature.values.push_back(ppSrc[i]);
-        returnFeatures[2].push_back(feature); // smoothed df is output 2
+	returnFeatures[0].push_back(feature); // onsets are output 0
+    }
+
+    int first = std::max(m_d->reported, from);
+    for (int i = first; i < limit; ++i) {
+        smoothed[i - from] *= scale;
+    }
+    addSmoothed(returnFeatures, &smoothed[first - from], first, limit);
+
+    m_d->reported = limit;
+
+    // Discard detection function that no later window will include
+
+    int keep = m_d->nextUpdate - history - lookahead;
+    if (keep > m_d->dfBase) {
+        int discard = std::min(keep - m_d->dfBase, int(m_d->dfOutput.size()));
+        m_d->dfOutput.erase(m_d->dfOutput.begin(),
+                            m_d->dfOutput.begin() + discard);
+        m_d->dfBase += discard;
     }
 
     return returnFeatures;
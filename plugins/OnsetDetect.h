@@ -17,6 +17,8 @@
 
 #include <vamp-sdk/Plugin.h>
 
+#include <vector>
+
 class OnsetDetectorData;
 
 class OnsetDetector : public Vamp::Plugin
@@ -30,6 +32,9 @@ public:
 
     InputDomain getInputDomain() const { return FrequencyDomain; }
 
+    size_t getMinChannelCount() const;
+    size_t getMaxChannelCount() const;
+
     std::string getIdentifier() const;
     std::string getName() const;
     std::string getDescription() const;
@@ -57,11 +62,39 @@ public:
 
 protected:
     OnsetDetectorData *m_d;
+    int m_channels;
     int m_dfType;
     float m_sensitivity;
     bool m_whiten;
+
+    // Online detection, in which onsets and the smoothed detection
+    // function are reported from process() once they are m_lookahead
+    // seconds behind the input
+    bool m_online;
+    float m_lookahead;
+
+    // Return the smoothed detection function in a single feature
+    // rather than one feature per frame
+    bool m_compact;
+
+    // If non-zero, the step between sensitivities at which onsets
+    // are also found for the sweep output
+    int m_sweepStep;
+
+    // Calculate a detection function for each input channel and sum
+    // them, rather than one from the mean of the channels
+    bool m_perChannel;
+
     std::string m_program;
     static float m_preferredStepSecs;
+
+    double threshold(double value, float sensitivity) const;
+    void pickPeaks(double *df, int length, std::vector<int> &peaks,
+                   float sensitivity) const;
+    int findOnset(const double *smoothed, int peak) const;
+    void addSmoothed(FeatureSet &features, const double *smoothed,
+                     int from, int to) const;
+    FeatureSet detectOnline(bool final);
 };
 
 
@@ -0,0 +1,309 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    QM Vamp Plugin Set
+
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "SharedDetectionFunction.h"
+
+#include <thread/Thread.h>
+
+#include <atomic>
+#include <cstring>
+
+using std::vector;
+
+typedef SharedDetectionFunction::Key Key;
+
+bool
+Key::operator==(const Key &k) const
+{
+    if (domain != k.domain || type != k.type ||
+        stepSize != k.stepSize || frameLength != k.frameLength ||
+        dbRise != k.dbRise) {
+        return false;
+    }
+    for (int i = 0; i < 3; ++i) {
+        if (frames[i] != k.frames[i]) return false;
+    }
+    return true;
+}
+
+// The cache is a table of CacheSize entries, each holding the most
+// recent output whose key hashes to it, and each with its own mutex
+// so that instances running in different threads rarely wait for
+// one another.  Instances run together by a host process the same
+// frame at about the same time, so only a few entries are needed for
+// each configuration in use.  Each entry also holds a copy of its
+// current frame, which is compared with the frame being looked up so
+// that a hash collision on it cannot return the wrong output.  Once
+// every entry has held a frame, nothing is allocated.
+
+static const int CacheSize = 64;
+
+struct CacheEntry
+{
+    CacheEntry() : used(false), output(0) { }
+    bool used;
+    Key key;
+    vector<double> frame;
+    double output;
+};
+
+static Mutex cacheMutex[CacheSize];
+static CacheEntry cache[CacheSize];
+
+// Each configuration in use is registered with a count of the
+// instances using it.  Nothing is looked up or stored for a
+// configuration until it has had a second instance, so that an
+// instance running alone pays nothing for sharing.
+
+static const int RegistrySize = 64;
+
+struct Registration
+{
+    Registration() : instances(0), shared(false) { }
+    int instances;
+    int type;
+    int stepSize;
+    int frameLength;
+    double dbRise;
+    std::atomic<bool> shared;
+};
+
+static Mutex registryMutex;
+static Registration registry[RegistrySize];
+
+static uint64_t
+hashFrame(const vector<double> &frame)
+{
+    // FNV-1a, taking a whole double at a time
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < frame.size(); ++i) {
+        uint64_t w;
+        memcpy(&w, &frame[i], sizeof(w));
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static int
+slotFor(const Key &key)
+{
+    uint64_t w;
+    memcpy(&w, &key.dbRise, sizeof(w));
+    uint64_t fields[] = {
+        uint64_t(key.domain), uint64_t(key.type), uint64_t(key.stepSize),
+        uint64_t(key.frameLength), w,
+        key.frames[0], key.frames[1], key.frames[2]
+    };
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < int(sizeof(fields) / sizeof(fields[0])); ++i) {
+        h = (h ^ fields[i]) * 1099511628211ULL;
+    }
+    return int(h % CacheSize);
+}
+
+static bool
+lookup(const Key &key, const vector<double> &frame, double &output)
+{
+    int slot = slotFor(key);
+    bool found = false;
+    cacheMutex[slot].lock();
+    const CacheEntry &e = cache[slot];
+    if (e.used && e.key == key && e.frame == frame) {
+        output = e.output;
+        found = true;
+    }
+    cacheMutex[slot].unlock();
+    return found;
+}
+
+static void
+store(const Key &key, const vector<double> &frame, double output)
+{
+    int slot = slotFor(key);
+    cacheMutex[slot].lock();
+    CacheEntry &e = cache[slot];
+    e.used = true;
+    e.key = key;
+    e.frame = frame;
+    e.output = output;
+    cacheMutex[slot].unlock();
+}
+
+static double
+registeredRise(const DFConfig &config)
+{
+    return config.DFType == DF_BROADBAND ? config.dbRise : 0.0;
+}
+
+static Registration *
+registerInstance(const DFConfig &config)
+{
+    Registration *r = 0;
+    registryMutex.lock();
+    for (int i = 0; i < RegistrySize; ++i) {
+        Registration &e = registry[i];
+        if (e.instances > 0 &&
+            e.type == config.DFType &&
+            e.stepSize == int(config.stepSize) &&
+            e.frameLength == int(config.frameLength) &&
+            e.dbRise == registeredRise(config)) {
+            r = &e;
+            break;
+        }
+    }
+    if (!r) {
+        for (int i = 0; i < RegistrySize; ++i) {
+            if (registry[i].instances == 0) {
+                r = &registry[i];
+                r->type = config.DFType;
+                r->stepSize = config.stepSize;
+                r->frameLength = config.frameLength;
+                r->dbRise = registeredRise(config);
+                r->shared = false;
+                break;
+            }
+        }
+    }
+    if (r) {
+        ++r->instances;
+        if (r->instances > 1) r->shared = true;
+    }
+    registryMutex.unlock();
+    return r;
+}
+
+static void
+unregisterInstance(Registration *r)
+{
+    if (!r) return;
+    registryMutex.lock();
+    --r->instances;
+    registryMutex.unlock();
+}
+
+SharedDetectionFunction::SharedDetectionFunction(const DFConfig &config) :
+    m_config(config),
+    m_df(new DetectionFunction(config)),
+    m_shared(!config.adaptiveWhitening),
+    m_registration(0),
+    m_previous(0),
+    m_fromStart(true),
+    m_behind(false)
+{
+    m_len[0] = 0;
+    m_len[1] = 0;
+    for (int i = 0; i < 3; ++i) m_hashes[i] = 0;
+    if (m_shared) m_registration = registerInstance(config);
+}
+
+SharedDetectionFunction::~SharedDetectionFunction()
+{
+    unregisterInstance(m_registration);
+    delete m_df;
+}
+
+bool
+SharedDetectionFunction::isSharing()
+{
+    // With no registration (the registry being full), always share
+    if (!m_shared) return false;
+    if (!m_registration || m_registration->shared) return true;
+
+    // Running alone, so the frame history is not being kept, and the
+    // cache cannot be used until it has been rebuilt
+    m_previous = 0;
+    m_fromStart = false;
+    return false;
+}
+
+double
+SharedDetectionFunction::processFrequencyDomain(const double *reals,
+                                                const double *imags)
+{
+    if (!isSharing()) return m_df->processFrequencyDomain(reals, imags);
+
+    m_len[0] = m_config.frameLength / 2 + 1;
+    m_len[1] = m_len[0];
+    return process(FrequencyDomain, reals, imags);
+}
+
+double
+SharedDetectionFunction::processTimeDomain(const double *samples)
+{
+    if (!isSharing()) return m_df->processTimeDomain(samples);
+
+    m_len[0] = m_config.frameLength;
+    m_len[1] = 0;
+    return process(TimeDomain, samples, 0);
+}
+
+double
+SharedDetectionFunction::run(Domain domain, const double *frame)
+{
+    if (domain == TimeDomain) {
+        return m_df->processTimeDomain(frame);
+    } else {
+        return m_df->processFrequencyDomain(frame, frame + m_len[0]);
+    }
+}
+
+double
+SharedDetectionFunction::process(Domain domain, const double *a, const double *b)
+{
+    vector<double> &frame = m_frames[0];
+    frame.resize(m_len[0] + m_len[1]);
+    if (m_len[0] > 0) memcpy(&frame[0], a, m_len[0] * sizeof(double));
+    if (m_len[1] > 0) memcpy(&frame[m_len[0]], b, m_len[1] * sizeof(double));
+    m_hashes[0] = hashFrame(frame);
+
+    Key key;
+    key.domain = domain;
+    key.type = m_config.DFType;
+    key.stepSize = m_config.stepSize;
+    key.frameLength = m_config.frameLength;
+    key.dbRise = (m_config.DFType == DF_BROADBAND ? m_config.dbRise : 0.0);
+    for (int i = 0; i < 3; ++i) {
+        key.frames[i] = (i <= m_previous ? m_hashes[i] : 0);
+    }
+
+    // Keys for the first frames of the input leave out the previous
+    // frames that do not exist.  Elsewhere, both previous frames must
+    // be known.
+    bool usable = (m_fromStart || m_previous == 2);
+
+    double output = 0.0;
+    bool found = usable && lookup(key, frame, output);
+
+    if (!found) {
+        if (m_behind) {
+            // Oldest first, so as to leave m_df in the state it would
+            // have been in had it been run on every frame
+            for (int i = m_previous; i > 0; --i) {
+                run(domain, &m_frames[i][0]);
+            }
+        }
+        output = run(domain, &frame[0]);
+        if (usable) store(key, frame, output);
+    }
+
+    m_behind = found;
+
+    m_frames[2].swap(m_frames[1]);
+    m_frames[1].swap(m_frames[0]);
+    m_hashes[2] = m_hashes[1];
+    m_hashes[1] = m_hashes[0];
+    if (m_previous < 2) ++m_previous;
+
+    return output;
+}
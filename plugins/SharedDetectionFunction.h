@@ -0,0 +1,103 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    QM Vamp Plugin Set
+
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef _SHARED_DETECTION_FUNCTION_H_
+#define _SHARED_DETECTION_FUNCTION_H_
+
+#include <dsp/onsets/DetectionFunction.h>
+
+#include <vector>
+#include <stdint.h>
+
+struct Registration;
+
+/**
+ * A DetectionFunction whose output is shared between all the plugin
+ * instances in the library that are given the same input with the
+ * same configuration, as when a host runs the onset detector, beat
+ * tracker and bar and beat tracker over the same audio together.
+ *
+ * Without adaptive whitening, the output of a DetectionFunction for a
+ * frame depends only on that frame and the two before it.  Each
+ * output is therefore published to a process-wide cache, keyed by the
+ * configuration, the input domain and those three frames, and any
+ * instance that finds its output there uses it instead of running its
+ * own DetectionFunction.  An instance's DetectionFunction then falls
+ * behind; when it next has to calculate an output itself, it first
+ * brings it up to date by running it on the two previous frames,
+ * which it keeps for the purpose.  Outputs are identical to those of
+ * an unshared DetectionFunction.
+ *
+ * Nothing is published or looked up for a configuration until a
+ * second instance with it has been created, so an instance running
+ * on its own calls its DetectionFunction directly.
+ *
+ * With adaptive whitening, the output depends on the whole of the
+ * input so far, and nothing is shared.
+ */
+class SharedDetectionFunction
+{
+public:
+    SharedDetectionFunction(const DFConfig &config);
+    ~SharedDetectionFunction();
+
+    double processFrequencyDomain(const double *reals, const double *imags);
+    double processTimeDomain(const double *samples);
+
+    struct Key
+    {
+        int domain;
+        int type;
+        int stepSize;
+        int frameLength;
+        double dbRise;
+        uint64_t frames[3]; // hashes of the current and two previous frames
+
+        bool operator==(const Key &) const;
+    };
+
+private:
+    SharedDetectionFunction(const SharedDetectionFunction &); // not provided
+    SharedDetectionFunction &operator=(const SharedDetectionFunction &); // not provided
+
+    enum Domain { TimeDomain, FrequencyDomain };
+
+    bool isSharing();
+    double process(Domain domain, const double *a, const double *b);
+    double run(Domain domain, const double *frame);
+
+    DFConfig m_config;
+    DetectionFunction *m_df;
+    bool m_shared;
+    Registration *m_registration;
+
+    // Length of the first and second input arrays for each frame
+    // (the second being imaginaries, in the frequency domain)
+    int m_len[2];
+
+    // The current frame and the two previous ones, each stored as the
+    // concatenation of its input arrays, with their hashes and the
+    // number of previous frames actually seen (up to 2), and whether
+    // all frames since the start of the input have been seen
+    std::vector<double> m_frames[3];
+    uint64_t m_hashes[3];
+    int m_previous;
+    bool m_fromStart;
+
+    // True if m_df has not been run on the previous frames, because
+    // their outputs were found in the cache
+    bool m_behind;
+};
+
+#endif
@@ -18,7 +18,24 @@
 #include <vamp-sdk/PluginAdapter.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <algorithm>
+#include <vector>
+
+#include <thread/AsynchronousTask.h>
+
+// The resonator bank uses SSE2 wherever the compiler targets it, and
+// AVX when built with GCC or Clang for x86 and the CPU supports it.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TRANSCRIPTION_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRANSCRIPTION_AVX 1
+#include <immintrin.h>
+#endif
 
 using std::string;
 using std::vector;
@@ -93,7 +110,180 @@ const double EualCurve960[960] = {
     12.174175,12.369392,12.565329,12.761907,12.959049,13.156679,13.354718,13.553089,13.751715,13.950518,14.149420,14.348345,14.547211,14.745925,14.944391,
     15.142512,15.340191,15.537333,15.733840,15.929615,16.124564   
 };
-void Transcribe(int Len,int inputLen,double *SoundIn,double *out,double *outArray2,double *outArray3,double SampleRate);
+class TranscriptionPool;
+class TranscriptionScratch;
+
+// The resonator levels and pitch estimates, which are the largest
+// arrays in the analysis, are held in type T: double, or float when
+// the plugin's "precision" parameter asks for single precision.
+
+template <typename T>
+void Transcribe(int Len,int inputLen,double *SoundIn,double *out,double *outArray2,double *outArray3,double SampleRate,TranscriptionPool *Pool,TranscriptionScratch *Scratch);
+template <typename T>
+void TranscribeFrames(int Len,T *dbs,double *out,double *outArray2,double *outArray3,int FrameOffset,TranscriptionPool *Pool,TranscriptionScratch *Scratch);
+size_t TranscribeScratchSize(int Len,size_t ValueSize);
+size_t TranscribeFramesScratchSize(int Len,size_t ValueSize);
+size_t TranscriptionJobScratchSize(int Len);
+void RenderNotes(const double *Notes,double *Roll,int RollLen,int AcceptFrom,int AcceptTo);
+void ScanNotes(double *Roll,int RollLen,int From,int To,double *Starts,Vamp::RealTime Base,Vamp::Plugin::FeatureList &Features);
+void CloseNotes(int To,double *Starts,Vamp::RealTime Base,Vamp::Plugin::FeatureList &Features);
+
+class ResonatorBank;
+
+// Scratch space for the analysis, used as a stack: allocate() takes
+// space from the top, and release() gives back everything allocated
+// since the corresponding mark().  Each instance serves one thread.
+// Requests beyond the reserved capacity fall back to the heap, and
+// the capacity is enlarged to cover them the next time the stack is
+// emptied, so a repeated analysis of the same size is allocation-free.
+
+class TranscriptionScratch
+{
+public:
+    TranscriptionScratch();
+    ~TranscriptionScratch();
+
+    // Make room for n doubles.  Only has effect when nothing is
+    // allocated.
+    void reserve(size_t n);
+
+    double *allocate(size_t n);
+
+    // Allocate n values of type T, which may be double or float.
+    template <typename T>
+    T *allocateArray(size_t n) {
+        return (T *)allocate((n * sizeof(T) + sizeof(double) - 1) / sizeof(double));
+    }
+
+    size_t mark() const { return m_used; }
+    void release(size_t mark);
+
+private:
+    double *m_block;
+    size_t m_capacity;
+    size_t m_used;
+    size_t m_peak;
+    std::vector<std::pair<size_t, double *> > m_overflow;
+};
+
+// A set of worker threads among which ranges of frames, notes or
+// onsets are divided.  Each job writes only to the part of its
+// output belonging to its own range, so the results do not depend
+// on the number of threads.
+
+typedef void (*TranscriptionJob)(void *Data, int From, int To,
+                                 TranscriptionScratch *Scratch);
+
+class TranscriptionPool
+{
+public:
+    TranscriptionPool(int Threads);
+    ~TranscriptionPool();
+
+    // Divide [From, To) into one contiguous range per thread, run
+    // Job on each (the last on the calling thread, with Scratch, and
+    // the others with their own scratch space), and wait for all of
+    // them to finish.
+    void run(TranscriptionJob Job, void *Data, int From, int To,
+             TranscriptionScratch *Scratch);
+
+    // Reserve n doubles of scratch space for each worker thread.
+    void reserve(size_t n);
+
+private:
+    class Worker : public AsynchronousTask
+    {
+    public:
+        Worker() : m_job(0), m_data(0), m_from(0), m_to(0) { }
+
+        void start(TranscriptionJob job, void *data, int from, int to) {
+            m_job = job;
+            m_data = data;
+            m_from = from;
+            m_to = to;
+            startTask();
+        }
+
+        void await() {
+            awaitTask();
+        }
+
+        void reserve(size_t n) {
+            m_scratch.reserve(n);
+        }
+
+    protected:
+        TranscriptionJob m_job;
+        void *m_data;
+        int m_from;
+        int m_to;
+
+        TranscriptionScratch m_scratch;
+
+        void performTask() {
+            m_job(m_data, m_from, m_to, &m_scratch);
+        }
+    };
+
+    std::vector<Worker *> m_workers;
+};
+
+// Run Job over [From, To), on the pool's threads if there is a pool.
+
+void RunJob(TranscriptionPool *Pool, TranscriptionJob Job, void *Data, int From, int To,
+            TranscriptionScratch *Scratch);
+
+// Incremental analysis for the streaming mode.  The resonator levels
+// are kept for a window of StreamWindow frames only; each time the
+// window fills, it is transcribed as a whole, and the notes starting
+// within the StreamHop frames that follow the first StreamContext
+// frames are accepted.  The window then advances by StreamHop, so
+// every accepted note has been analysed with at least StreamContext
+// frames of context either side of its onset.  Accepted notes are
+// drawn into a piano roll of the same length, which is scanned for
+// finished notes as far as no later window can affect it.
+
+static const int StreamWindow = 2000;
+static const int StreamContext = 500;
+static const int StreamHop = 1000;
+
+class TranscriptionStream
+{
+public:
+    TranscriptionStream(double SampleRate, int BlockSize, bool Single,
+                        TranscriptionPool *Pool, TranscriptionScratch *Scratch);
+    ~TranscriptionStream();
+
+    void process(const float *Input, Vamp::RealTime Base,
+                 Vamp::Plugin::FeatureList &Features);
+
+    // Analyse whatever remains, given the total number of frames
+    // in the input, and close any notes still sounding.
+    void finish(int TotalFrames, Vamp::RealTime Base,
+                Vamp::Plugin::FeatureList &Features);
+
+private:
+    void analyse(int Len, int AcceptFrom, int AcceptTo);
+
+    ResonatorBank *m_bank;
+    TranscriptionPool *m_pool;
+    TranscriptionScratch *m_scratch;
+    int m_blockSize;
+    double *m_input;
+    double *m_levels;
+    double *m_levelsdb;
+    bool m_single;
+    double *m_dbs;
+    float *m_dbsSingle;
+    int m_frames;
+    int m_base;
+    double *m_out;
+    double *m_out2;
+    double *m_notes;
+    double *m_roll;
+    double m_starts[88];
+    int m_scanned;
+};
 
 Transcription::Transcription(float inputSampleRate) :
     Plugin(inputSampleRate),
@@ -103,11 +293,20 @@ Transcription::Transcription(float inputSampleRate) :
     m_SampleN=0;
     m_AllocN = 0;
     m_Excess = false;
+    m_streaming = false;
+    m_stream = 0;
+    m_threads = 1;
+    m_pool = 0;
+    m_scratch = 0;
+    m_single = false;
 }
 
 Transcription::~Transcription()
 {
     free(m_SoundIn);
+    delete m_stream;
+    delete m_pool;
+    delete m_scratch;
 }
 
 string
@@ -158,6 +357,73 @@ Transcription::getPreferredBlockSize() const
     return 441;
 }
 
+Transcription::ParameterList
+Transcription::getParameterDescriptors() const
+{
+    ParameterList list;
+
+    ParameterDescriptor desc;
+    desc.identifier = "streaming";
+    desc.name = "Streaming";
+    desc.description = "Analyse the input in overlapping windows as it arrives, returning notes as they are completed and using a fixed amount of memory regardless of input length. Results may differ slightly from those obtained by analysing the whole input at once";
+    desc.unit = "";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = 0;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    list.push_back(desc);
+
+    desc.identifier = "precision";
+    desc.name = "Intermediate precision";
+    desc.description = "Precision in which to hold the resonator levels and pitch estimates. Single precision halves the memory used by these arrays, at the cost of small differences in the results";
+    desc.unit = "";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = 0;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.valueNames.push_back("Double");
+    desc.valueNames.push_back("Single");
+    list.push_back(desc);
+    desc.valueNames.clear();
+
+    desc.identifier = "threads";
+    desc.name = "Threads";
+    desc.description = "Number of threads among which to divide the analysis. The results are the same whatever the number of threads";
+    desc.unit = "";
+    desc.minValue = 1;
+    desc.maxValue = 16;
+    desc.defaultValue = 1;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    list.push_back(desc);
+
+    return list;
+}
+
+float
+Transcription::getParameter(std::string id) const
+{
+    if (id == "streaming") return (m_streaming ? 1 : 0);
+    else if (id == "precision") return (m_single ? 1 : 0);
+    else if (id == "threads") return m_threads;
+    return 0.f;
+}
+
+void
+Transcription::setParameter(std::string id, float value)
+{
+    if (id == "streaming") {
+        m_streaming = (value > 0.5);
+    } else if (id == "precision") {
+        m_single = (value > 0.5);
+    } else if (id == "threads") {
+        int n = lrintf(value);
+        if (n >= 1 && n <= 16) m_threads = n;
+    }
+}
+
 bool
 Transcription::initialise(size_t channels, size_t stepSize, size_t blockSize)
 {
@@ -171,6 +437,24 @@ Transcription::initialise(size_t channels, size_t stepSize, size_t blockSize)
 
     m_SampleN = 0;
 
+    delete m_stream;
+    m_stream = 0;
+    delete m_pool;
+    m_pool = 0;
+    delete m_scratch;
+    m_scratch = new TranscriptionScratch();
+    if (m_threads > 1) {
+        m_pool = new TranscriptionPool(m_threads);
+    }
+    if (m_streaming) {
+        m_stream = new TranscriptionStream(m_inputSampleRate, m_blockSize,
+                                           m_single, m_pool, m_scratch);
+        m_scratch->reserve(TranscribeFramesScratchSize(StreamWindow, m_single ? sizeof(float) : sizeof(double)));
+        if (m_pool) {
+            m_pool->reserve(TranscriptionJobScratchSize(StreamWindow));
+        }
+    }
+
     return true;
 }
 
@@ -183,6 +467,12 @@ Transcription::reset()
     m_AllocN = 0;
     m_Excess = false;
     m_Base = Vamp::RealTime();
+
+    if (m_stream) {
+        delete m_stream;
+        m_stream = new TranscriptionStream(m_inputSampleRate, m_blockSize,
+                                           m_single, m_pool, m_scratch);
+    }
 }
 
 Transcription::OutputList
@@ -336,6 +626,13 @@ Transcription::process(const float *const *inputBuffers,
         m_Base = timestamp;
     }
 
+    if (m_stream) {
+        FeatureSet returnFeatures;
+        m_stream->process(inputBuffers[0], m_Base, returnFeatures[0]);
+        m_SampleN = m_SampleN + m_blockSize;
+        return returnFeatures;
+    }
+
     if (m_Excess) return FeatureSet();
 
     for (int i = 0; i < m_blockSize;i++) {
@@ -369,7 +666,6 @@ Transcription::getRemainingFeatures()
     double *hello1;
     double *hello2;
     int Msec;
-    int i;
     int j;
     int n;
 
@@ -377,10 +673,22 @@ Transcription::getRemainingFeatures()
 
     if (Msec < 100) return returnFeatures;
 
-    OutArray=(double *)malloc(3*3000*sizeof(double));
-    OutArray2=(double *)malloc(88*Msec*sizeof(double));
-    hello1=(double *)malloc(112*Msec*sizeof(double));
-    hello2=(double *)malloc(112*Msec*sizeof(double));
+    if (m_stream) {
+        m_stream->finish(Msec, m_Base, returnFeatures[0]);
+        return returnFeatures;
+    }
+
+    m_scratch->reserve(3*3000 + (88+2*112)*Msec + TranscribeScratchSize(Msec, m_single ? sizeof(float) : sizeof(double)));
+    if (m_pool) {
+        m_pool->reserve(TranscriptionJobScratchSize(Msec));
+    }
+
+    size_t ScratchMark = m_scratch->mark();
+
+    OutArray=m_scratch->allocate(3*3000);
+    OutArray2=m_scratch->allocate(88*Msec);
+    hello1=m_scratch->allocate(112*Msec);
+    hello2=m_scratch->allocate(112*Msec);
 	
     for (j = 0; j <Msec; j++) {
 
@@ -393,9 +701,11 @@ Transcription::getRemainingFeatures()
     }
 
     
-    Transcribe(Msec,m_SampleN,m_SoundIn,hello1,hello2,OutArray,m_inputSampleRate);
-    int start;
-    int endd;
+    if (m_single) {
+        Transcribe<float>(Msec,m_SampleN,m_SoundIn,hello1,hello2,OutArray,m_inputSampleRate,m_pool,m_scratch);
+    } else {
+        Transcribe<double>(Msec,m_SampleN,m_SoundIn,hello1,hello2,OutArray,m_inputSampleRate,m_pool,m_scratch);
+    }
 
 
     /* for (i = 0; i < 3000; i++) {
@@ -432,16 +742,43 @@ Transcription::getRemainingFeatures()
     */
 
     
+    RenderNotes(OutArray,OutArray2,Msec,0,Msec);
+
+    double starts[88];
+    for (n = 0; n < 88; ++n) starts[n] = -1.0;
+
+    ScanNotes(OutArray2,Msec,0,Msec,starts,m_Base,returnFeatures[0]);
+    CloseNotes(Msec,starts,m_Base,returnFeatures[0]);
+
+    m_scratch->release(ScratchMark);
+
+    return returnFeatures;
+
+}
+
+// Draw the notes listed in Notes (as returned by Transcribe) whose
+// start frames lie in [AcceptFrom, AcceptTo) into a piano roll of
+// RollLen frames, with frame j found at row j % RollLen.
+
+void RenderNotes(const double *Notes,double *Roll,int RollLen,int AcceptFrom,int AcceptTo)
+{
+    int i,j,n;
+    int start,endd;
+
     for (i = 0; i < 3000; i++) {
 
-        if((OutArray[3*i]>0)&&(OutArray[3*i]<88))
+        if((Notes[3*i]>0)&&(Notes[3*i]<88))
         {
-            start=100*OutArray[3*i+1];
-            endd=100*OutArray[3*i+2]-5;
+            start=100*Notes[3*i+1];
+            endd=100*Notes[3*i+2]-5;
+            if(start<AcceptFrom||start>=AcceptTo)
+            {
+                continue;
+            }
             for(j=start;j<endd;j++)
             {
-                n=OutArray[3*i];
-                OutArray2[j*88+n]=OutArray[3*i];
+                n=Notes[3*i];
+                Roll[(j%RollLen)*88+n]=Notes[3*i];
             }
        
         }
@@ -453,185 +790,489 @@ Transcription::getRemainingFeatures()
 
 
     }
+}
 
-    double starts[88];
-    for (n = 0; n < 88; ++n) starts[n] = -1.0;
+// Scan frames [From, To) of the piano roll, clearing each row as it
+// is read, and add a feature for every note found to end there.
+// Starts holds the start time of each note still sounding, or -1.
 
-    for (j = 0; j <Msec; j++) {
+void ScanNotes(double *Roll,int RollLen,int From,int To,double *Starts,Vamp::RealTime Base,Vamp::Plugin::FeatureList &Features)
+{
+    int j,n;
+    double *row;
+
+    for (j = From; j <To; j++) {
         
+        row=Roll+(j%RollLen)*88;
+
         for(n=0;n<88;n++)
         {
-            if(OutArray2[j*88+n]>0)
+            if(row[n]>0)
             {
 
-                if (starts[n] < 0.)
+                if (Starts[n] < 0.)
                 {
-                    starts[n] = j * 0.01;
+                    Starts[n] = j * 0.01;
                 }
             }
             else 
             {
-                if (starts[n] > 0.)
+                if (Starts[n] > 0.)
                 {
-                    Feature feature;
+                    Vamp::Plugin::Feature feature;
                     feature.hasTimestamp = true;
-                    feature.timestamp = m_Base + Vamp::RealTime::fromSeconds(starts[n]);
+                    feature.timestamp = Base + Vamp::RealTime::fromSeconds(Starts[n]);
                     feature.hasDuration = true;
-                    feature.duration = Vamp::RealTime::fromSeconds(j * 0.01 - starts[n]);
+                    feature.duration = Vamp::RealTime::fromSeconds(j * 0.01 - Starts[n]);
                     feature.values.push_back(n+20);
-                    returnFeatures[0].push_back(feature);
+                    Features.push_back(feature);
 
-                    starts[n] = -1.0;
+                    Starts[n] = -1.0;
                 }
             }
+
+            row[n]=0;
         }
     }
+}
+
+// Add a feature for every note still sounding at frame To.
+
+void CloseNotes(int To,double *Starts,Vamp::RealTime Base,Vamp::Plugin::FeatureList &Features)
+{
+    int n;
 
-     
     for(n=0;n<88;n++)
     {
-        if (starts[n] > 0.)
+        if (Starts[n] > 0.)
         {
-            Feature feature;
+            Vamp::Plugin::Feature feature;
             feature.hasTimestamp = true;
-            feature.timestamp = m_Base + Vamp::RealTime::fromSeconds(starts[n]);
+            feature.timestamp = Base + Vamp::RealTime::fromSeconds(Starts[n]);
             feature.hasDuration = true;
-            feature.duration = Vamp::RealTime::fromSeconds(j * 0.01 - starts[n]);
+            feature.duration = Vamp::RealTime::fromSeconds(To * 0.01 - Starts[n]);
             feature.values.push_back(n+20);
-            returnFeatures[0].push_back(feature);
+            Features.push_back(feature);
 
-            starts[n] = -1.0;
+            Starts[n] = -1.0;
         }
     }
+}
+
 
-    free(OutArray2);
-    free(OutArray);
 
-    free(hello1);
-    free(hello2);
 
-    return returnFeatures;
 
+TranscriptionPool::TranscriptionPool(int Threads)
+{
+    for (int i = 1; i < Threads; ++i) {
+        m_workers.push_back(new Worker());
+    }
+}
+
+TranscriptionPool::~TranscriptionPool()
+{
+    for (int i = 0; i < int(m_workers.size()); ++i) {
+        delete m_workers[i];
+    }
 }
 
+void
+TranscriptionPool::run(TranscriptionJob Job, void *Data, int From, int To,
+                       TranscriptionScratch *Scratch)
+{
+    int n = int(m_workers.size()) + 1;
 
+    for (int i = 0; i < n - 1; ++i) {
+        m_workers[i]->start(Job, Data,
+                            From + (To - From) * i / n,
+                            From + (To - From) * (i + 1) / n);
+    }
 
+    Job(Data, From + (To - From) * (n - 1) / n, To, Scratch);
 
+    for (int i = 0; i < n - 1; ++i) {
+        m_workers[i]->await();
+    }
+}
 
-void sofacomplexMex(double *y, double *z, int ncols,double StartNote,double NoteInterval1,double NoteNum,double C,double D,double SR)
+void
+TranscriptionPool::reserve(size_t n)
 {
-    int mseconds,i,el,count,count2;
-    double  Snote,NoteInterval,NoteN;
-    double  *signs;
-    double  *rwork;  
-    double  freq,R,gain,gainI,gainII,coefI,coefM;
-    double output,input,outputI,outputM;
-    double *x;
-    double *sum,*sum2;
-    double power;
-    
+    for (int i = 0; i < int(m_workers.size()); ++i) {
+        m_workers[i]->reserve(n);
+    }
+}
+
+void RunJob(TranscriptionPool *Pool, TranscriptionJob Job, void *Data, int From, int To,
+            TranscriptionScratch *Scratch)
+{
+    if (Pool && To - From > 1) {
+        Pool->run(Job, Data, From, To, Scratch);
+    } else {
+        Job(Data, From, To, Scratch);
+    }
+}
+
+TranscriptionScratch::TranscriptionScratch() :
+    m_block(0),
+    m_capacity(0),
+    m_used(0),
+    m_peak(0)
+{
+}
+
+TranscriptionScratch::~TranscriptionScratch()
+{
+    for (int i = 0; i < int(m_overflow.size()); ++i) {
+        free(m_overflow[i].second);
+    }
+    free(m_block);
+}
+
+void
+TranscriptionScratch::reserve(size_t n)
+{
+    if (m_used > 0 || n <= m_capacity) return;
+
+    free(m_block);
+    m_block = (double *)malloc(n * sizeof(double));
+    m_capacity = (m_block ? n : 0);
+}
+
+double *
+TranscriptionScratch::allocate(size_t n)
+{
+    double *p;
+
+    if (m_used + n <= m_capacity) {
+        p = m_block + m_used;
+    } else {
+        p = (double *)malloc(n * sizeof(double));
+        m_overflow.push_back(std::pair<size_t, double *>(m_used, p));
+    }
+
+    m_used += n;
+    if (m_used > m_peak) m_peak = m_used;
+
+    return p;
+}
+
+void
+TranscriptionScratch::release(size_t mark)
+{
+    while (!m_overflow.empty() && m_overflow.back().first >= mark) {
+        free(m_overflow.back().second);
+        m_overflow.pop_back();
+    }
+
+    m_used = mark;
+
+    if (m_used == 0 && m_peak > m_capacity) {
+        reserve(m_peak);
+    }
+}
+
+// Bank of two-pole resonators, one per analysed note, whose output
+// energies are summed over each 10ms frame.  The filter state is kept
+// between calls, so the input may be supplied in pieces of any size.
+
+class ResonatorBank
+{
+public:
+    // Notes FirstNote up to (not including) LastNote of the NoteNum
+    // are run, or all of them if LastNote is negative.
+    ResonatorBank(double StartNote, double NoteInterval1, double NoteNum,
+                  double C, double D, double SR,
+                  int FirstNote = 0, int LastNote = -1);
+    ~ResonatorBank();
+
+    int getNoteCount() const { return NoteN; }
+    int getHop() const { return hop; }
+
+    // Filter n samples of input, writing a row of NoteNum values to z
+    // for each frame completed (of which only the values for this
+    // bank's notes are touched).  Returns the number of rows written.
+    template <typename T>
+    int process(const double *y, int n, T *z);
+
+private:
+    // The filter coefficients and state are held as one array per
+    // quantity, padded to a multiple of 4 notes (the padding notes
+    // have zero coefficients), so that several resonators can be
+    // advanced at once.  Each filter function runs every resonator
+    // over n samples, which must not cross a frame boundary.
+
+    void filterScalar(const double *y, int n);
+#ifdef TRANSCRIPTION_SSE2
+    void filterSSE2(const double *y, int n);
+#endif
+#ifdef TRANSCRIPTION_AVX
+    void filterAVX(const double *y, int n);
+#endif
+
+    void (ResonatorBank::*filter)(const double *y, int n);
+
+    int NoteN;
+    int NotePad;
+    int First;
+    int Stride;
+    int hop;
+    int count;
+    double *gain2;
+    double *gainI;
+    double *gainII;
+    double *coefI;
+    double *coefM;
+    double *x0;
+    double *x1;
+    double *sum;
+    double *sum2;
+};
+
+ResonatorBank::ResonatorBank(double StartNote, double NoteInterval1, double NoteNum,
+                             double C, double D, double SR,
+                             int FirstNote, int LastNote)
+{
+    int i;
+    double Snote,NoteInterval;
+    double freq,R,gain;
+
     //SR=44100;
     Snote=StartNote;
     NoteInterval=NoteInterval1;
-    NoteN=NoteNum;
+    Stride=(int)NoteNum;
+    First=FirstNote;
+    if (LastNote<0) LastNote=Stride;
+    NoteN=LastNote-First;
+    NotePad=(NoteN+3)/4*4;
+    hop=(int)(SR/100);
+    count=0;
   
-    signs=(double*)malloc((int)NoteN*5*sizeof(double));
+    gain2=(double*)malloc(NotePad*sizeof(double));
+    gainI=(double*)malloc(NotePad*sizeof(double));
+    gainII=(double*)malloc(NotePad*sizeof(double));
+    coefI=(double*)malloc(NotePad*sizeof(double));
+    coefM=(double*)malloc(NotePad*sizeof(double));
+    x0=(double*)malloc(NotePad*sizeof(double));
+    x1=(double*)malloc(NotePad*sizeof(double));
+    sum=(double*)malloc(NotePad*sizeof(double));
+    sum2=(double*)malloc(NotePad*sizeof(double));
+
+    for (i = 0; i <NotePad; i++) {
+
+        gain2[i]=0;
+        gainI[i]=0;
+        gainII[i]=0;
+        coefI[i]=0;
+        coefM[i]=0;
+        x0[i]=0;
+        x1[i]=0;
+        sum[i]=0;
+        sum2[i]=0;
+    }
      
     for (i = 0; i <NoteN; i++) {
            
-        freq=exp((log(2.0))*(Snote+i*NoteInterval-69)/12)*440;
+        freq=exp((log(2.0))*(Snote+(First+i)*NoteInterval-69)/12)*440;
         R=exp(-(D+C*freq*2*3.1415926)/(SR*3.1415926)); 
         gain=(1*(sqrt(1+R*R-2*R*cos(2*freq*2*3.1415926/SR)))-1*R*(sqrt(1+R*R-2*R*cos(2*freq*2*3.1415926/SR))))/sin(freq*2*3.1415926/SR);
-        gainI=-2*R*cos(freq*2*3.1415926/SR);
-        gainII =R*R ;
-        coefI=cos(freq*2*3.1415926/SR);
-        coefM=sin(freq*2*3.1415926/SR);
-            
-        signs[i*5+0]=gain*gain;
-        signs[i*5+1]=gainI;
-        signs[i*5+2]=gainII;
-        signs[i*5+3]=coefI;
-        signs[i*5+4]=coefM;
+
+        gain2[i]=gain*gain;
+        gainI[i]=-2*R*cos(freq*2*3.1415926/SR);
+        gainII[i]=R*R ;
+        coefI[i]=cos(freq*2*3.1415926/SR);
+        coefM[i]=sin(freq*2*3.1415926/SR);
             
     }
-    
-    x=(double*)malloc((int)NoteN*2*sizeof(double));
-    rwork=(double*)malloc((int)NoteN*sizeof(double));
-    sum=(double*)malloc((int)NoteN*sizeof(double));
-    sum2=(double*)malloc((int)NoteN*sizeof(double));
-    mseconds=(int)(100*ncols/SR);
-    power=0;
-    for (i=0;i<mseconds*(int)(SR/100);i++)
-    { 
-        power=power+y[i]*y[i];
+
+    filter=&ResonatorBank::filterScalar;
+#ifdef TRANSCRIPTION_SSE2
+    filter=&ResonatorBank::filterSSE2;
+#endif
+#ifdef TRANSCRIPTION_AVX
+    if (__builtin_cpu_supports("avx")) {
+        filter=&ResonatorBank::filterAVX;
     }
-    power=sqrt(power);
-    for(i=0;i<NoteN*2;i++)
-        x[i]=0;
-    for (i=0;i<NoteN;i++)
-    {
-        sum[i]=0;
-        sum2[i]=0;
-    };
-    count=0;
+#endif
+}
+
+ResonatorBank::~ResonatorBank()
+{
+    free(gain2);
+    free(gainI);
+    free(gainII);
+    free(coefI);
+    free(coefM);
+    free(x0);
+    free(x1);
+    free(sum);
+    free(sum2);
+}
+
+template <typename T>
+int ResonatorBank::process(const double *y, int n, T *z)
+{
+    int i,el,seg,count2;
+
     count2=0;
-    for (i=0;i<(mseconds*(int)(SR/100));i++)
-    {    
-        count=count+1;
-        input=y[i];
-        for(el=0;el<NoteN;el++)
-        { 
-            output=(input-signs[5*el+1]*x[2*el+0]-signs[5*el+2]*x[2*el+1]);
-            outputI=output-signs[5*el+3]*x[2*el+0];
-            outputM=signs[5*el+4]*x[2*el+0];
-            sum[el]=sum[el]+signs[5*el+0]*(outputI*outputI+ outputM*outputM);
-            rwork[el]=output;
-            x[el+el+1]=x[el+el+0];
-            x[el+el+0]=rwork[el];
-                   
-        }
-        if(count==(int)(SR/100))
+    i=0;
+    while (i<n)
+    {
+        seg=hop-count;
+        if (seg>n-i) seg=n-i;
+
+        (this->*filter)(y+i,seg);
+
+        i=i+seg;
+        count=count+seg;
+
+        if(count==hop)
         {
             for(el=0;el<NoteN;el++)
             {
-                *(z+count2*(int)NoteN+el)=1000000*(sum[el]+sum2[el])/(2*(int)(SR/100))+0.00001;
+                *(z+count2*Stride+First+el)=1000000*(sum[el]+sum2[el])/(2*hop)+0.00001;
                 sum2[el]=sum[el];
                 sum[el]=0;
             }                 
             count2=count2+1;
             count=0;
         }
-       
-    }    
-    for (i=0;i<NoteN;i++)
+    }
+
+    return count2;
+}
+
+// All three filter functions evaluate the same expressions in the
+// same order, so they give identical results wherever the compiler
+// does not fuse multiplies and adds (as on x86 with SSE2 or AVX, but
+// not FMA).  Where it does, each frame value may differ from the
+// scalar result by a relative amount of the order of 1e-15.
+
+void ResonatorBank::filterScalar(const double *y, int n)
+{
+    int i,el;
+    double output,outputI,outputM;
+    double s,p0,p1;
+
+    for(el=0;el<NoteN;el++)
     {
-        sum[i]=0;
-        sum2[i]=0;
-    };
-    for (el=0;el<NoteN;el++)
-    {  
-        for (i=0;i<mseconds;i++)
+        s=sum[el];
+        p0=x0[el];
+        p1=x1[el];
+
+        for (i=0;i<n;i++)
+        {    
+            output=(y[i]-gainI[el]*p0-gainII[el]*p1);
+            outputI=output-coefI[el]*p0;
+            outputM=coefM[el]*p0;
+            s=s+gain2[el]*(outputI*outputI+ outputM*outputM);
+            p1=p0;
+            p0=output;
+        }
+
+        sum[el]=s;
+        x0[el]=p0;
+        x1[el]=p1;
+    }
+}
+
+#ifdef TRANSCRIPTION_SSE2
+
+void ResonatorBank::filterSSE2(const double *y, int n)
+{
+    int i,el;
+
+    for(el=0;el<NotePad;el+=2)
+    {
+        __m128d g=_mm_loadu_pd(gain2+el);
+        __m128d a1=_mm_loadu_pd(gainI+el);
+        __m128d a2=_mm_loadu_pd(gainII+el);
+        __m128d c=_mm_loadu_pd(coefI+el);
+        __m128d m=_mm_loadu_pd(coefM+el);
+        __m128d s=_mm_loadu_pd(sum+el);
+        __m128d p0=_mm_loadu_pd(x0+el);
+        __m128d p1=_mm_loadu_pd(x1+el);
+
+        for (i=0;i<n;i++)
         {
-            sum[el]=sum[el]+*(z+i*(int)NoteN+el);
-        }       
-            
+            __m128d output=_mm_sub_pd(_mm_sub_pd(_mm_set1_pd(y[i]),
+                                                 _mm_mul_pd(a1,p0)),
+                                      _mm_mul_pd(a2,p1));
+            __m128d outputI=_mm_sub_pd(output,_mm_mul_pd(c,p0));
+            __m128d outputM=_mm_mul_pd(m,p0);
+            s=_mm_add_pd(s,_mm_mul_pd(g,_mm_add_pd(_mm_mul_pd(outputI,outputI),
+                                                   _mm_mul_pd(outputM,outputM))));
+            p1=p0;
+            p0=output;
+        }
+
+        _mm_storeu_pd(sum+el,s);
+        _mm_storeu_pd(x0+el,p0);
+        _mm_storeu_pd(x1+el,p1);
     }
-         
-    free(x);
-    free(rwork);
-    free(sum);
-    free(sum2);
-    free(signs);
-         
 }
+
+#endif
+
+#ifdef TRANSCRIPTION_AVX
+
+__attribute__((target("avx")))
+void ResonatorBank::filterAVX(const double *y, int n)
+{
+    int i,el;
+
+    for(el=0;el<NotePad;el+=4)
+    {
+        __m256d g=_mm256_loadu_pd(gain2+el);
+        __m256d a1=_mm256_loadu_pd(gainI+el);
+        __m256d a2=_mm256_loadu_pd(gainII+el);
+        __m256d c=_mm256_loadu_pd(coefI+el);
+        __m256d m=_mm256_loadu_pd(coefM+el);
+        __m256d s=_mm256_loadu_pd(sum+el);
+        __m256d p0=_mm256_loadu_pd(x0+el);
+        __m256d p1=_mm256_loadu_pd(x1+el);
+
+        for (i=0;i<n;i++)
+        {
+            __m256d output=_mm256_sub_pd(_mm256_sub_pd(_mm256_set1_pd(y[i]),
+                                                       _mm256_mul_pd(a1,p0)),
+                                         _mm256_mul_pd(a2,p1));
+            __m256d outputI=_mm256_sub_pd(output,_mm256_mul_pd(c,p0));
+            __m256d outputM=_mm256_mul_pd(m,p0);
+            s=_mm256_add_pd(s,_mm256_mul_pd(g,_mm256_add_pd(_mm256_mul_pd(outputI,outputI),
+                                                            _mm256_mul_pd(outputM,outputM))));
+            p1=p0;
+            p0=output;
+        }
+
+        _mm256_storeu_pd(sum+el,s);
+        _mm256_storeu_pd(x0+el,p0);
+        _mm256_storeu_pd(x1+el,p1);
+    }
+}
+
+#endif
+
+void sofacomplexMex(double *y, double *z, int ncols,double StartNote,double NoteInterval1,double NoteNum,double C,double D,double SR)
+{
+    int mseconds;
+
+    ResonatorBank bank(StartNote, NoteInterval1, NoteNum, C, D, SR);
+
+    mseconds=(int)(100*ncols/SR);
+    bank.process(y, mseconds*bank.getHop(), z);
+}
+
        
-void FindMaxN( double *InputArray, int InputLen,int MaxOrder)
+void FindMaxN( double *InputArray, int InputLen,int MaxOrder,TranscriptionScratch *Scratch)
 {
     int i,j,MaxIndex = 0;
     double MaxValue; 
     double *In2;
+    size_t ScratchMark=Scratch->mark();
     
-    In2=(double*)malloc(InputLen*sizeof(double));
+    In2=Scratch->allocate(InputLen);
     for (i=0;i<InputLen;i++)
     {
         In2[i]=InputArray[i];
@@ -652,7 +1293,7 @@ void FindMaxN( double *InputArray, int InputLen,int MaxOrder)
         In2[MaxIndex]=0;        
     }
     
-    free(In2);
+    Scratch->release(ScratchMark);
 }
 
 double SumF(double *InputArray,int Start, int End)
@@ -683,12 +1324,13 @@ int round10(int x)
 }
  
 
-void ConToPitch1250(double *In, int InLen)
+void ConToPitch1250(double *In, int InLen,TranscriptionScratch *Scratch)
 {
     int i,j,k, nn,col;
     double *Out;
     const int A[12]={0, 120, 190, 240, 279, 310, 337, 360, 380, 399, 415, 430};
-    Out=(double*)malloc(InLen*sizeof(double));
+    size_t ScratchMark=Scratch->mark();
+    Out=Scratch->allocate(InLen);
 
 	   
     col=InLen;
@@ -727,7 +1369,7 @@ void ConToPitch1250(double *In, int InLen)
     }
     
     
-    free(Out);
+    Scratch->release(ScratchMark);
 }
 
 void Norm1(double *In, int InLen)
@@ -757,12 +1399,13 @@ void Norm1(double *In, int InLen)
     free(Out);
 }
 
-void Smooth(double *In, int InLen,int smoothLen)
+void Smooth(double *In, int InLen,int smoothLen,TranscriptionScratch *Scratch)
 {
     double sum;
     int i,j,nn,n,count;
     double *Out;
-    Out=(double*)malloc(InLen*sizeof(double));
+    size_t ScratchMark=Scratch->mark();
+    Out=Scratch->allocate(InLen);
     nn=InLen;
     n=(smoothLen-1)/2;
     for (i=0;i<nn;i++)
@@ -791,7 +1434,7 @@ void Smooth(double *In, int InLen,int smoothLen)
     for (i=0;i<InLen;i++)
         In[i]=Out[i];
    
-    free(Out);
+    Scratch->release(ScratchMark);
 }
 
 
@@ -850,7 +1493,8 @@ void FindPeaks(double *In, int InLen,double *Out1,double *Out2, int /* db */, in
 }
 
 
-void ConFrom1050To960(double *In, double *out, int InputLen)
+template <typename T>
+void ConFrom1050To960(const T *In, double *out, int InputLen)
 {
     int i,j;
 
@@ -866,12 +1510,13 @@ void ConFrom1050To960(double *In, double *out, int InputLen)
 
 }
 
-void Move( double *InputArray, int InputLen,int m)
+void Move( double *InputArray, int InputLen,int m,TranscriptionScratch *Scratch)
 {
     int i;
     double *OutArray;
+    size_t ScratchMark=Scratch->mark();
     
-    OutArray=(double *)malloc(InputLen*sizeof(double));
+    OutArray=Scratch->allocate(InputLen);
     for (i=0;i<InputLen;i++)
         OutArray[i]=0;
     
@@ -885,7 +1530,7 @@ void Move( double *InputArray, int InputLen,int m)
         InputArray[i]=OutArray[i];
     }
     
-    free(OutArray);
+    Scratch->release(ScratchMark);
 }
 
 
@@ -1124,13 +1769,14 @@ double MeanArray( double *InputArray, int InputHLen, int InputVLen)
     }
     return sum/count;          
 }
-void Mydiff( double *InputArray, int InputHLen, int InputVLen,int n)
+void Mydiff( double *InputArray, int InputHLen, int InputVLen,int n,TranscriptionScratch *Scratch)
 {
     int i;
     int j;
     double * OutArray;
+    size_t ScratchMark=Scratch->mark();
     
-    OutArray=(double*)malloc(InputHLen*InputVLen*sizeof(double));
+    OutArray=Scratch->allocate(InputHLen*InputVLen);
     
     for (i=0;i<InputVLen;i++)
     {
@@ -1159,15 +1805,16 @@ void Mydiff( double *InputArray, int InputHLen, int InputVLen,int n)
         }  
     }
     
-    free(OutArray);
+    Scratch->release(ScratchMark);
 }
 
-void PeakDetect(double *In, int InLen)
+void PeakDetect(double *In, int InLen,TranscriptionScratch *Scratch)
 {
     int i;
     double *Out1;
+    size_t ScratchMark=Scratch->mark();
  
-    Out1=(double*)malloc(InLen*sizeof(double));
+    Out1=Scratch->allocate(InLen);
     for (i=0;i<InLen;i++)
     {
         Out1[i]=0;   
@@ -1191,7 +1838,7 @@ void PeakDetect(double *In, int InLen)
         In[i]=Out1[i]; 
     }
  
-    free(Out1);
+    Scratch->release(ScratchMark);
 }
 void MeanV( double *InputArray, int InputHLen, int InputVLen, double *OutArray)
 {
@@ -1212,7 +1859,7 @@ void MeanV( double *InputArray, int InputHLen, int InputVLen, double *OutArray)
     }
                   
 }
-void Edetect(double *InputArray, int InputHLen, int InputVLen, double MinT, double db1,double *OutOne)
+void Edetect(double *InputArray, int InputHLen, int InputVLen, double MinT, double db1,double *OutOne,TranscriptionScratch *Scratch)
 {
     int i;
     int j;
@@ -1235,7 +1882,7 @@ void Edetect(double *InputArray, int InputHLen, int InputVLen, double MinT, doub
     }
     
     MinArray(InputArray, InputHLen, InputVLen, -100);
-    Mydiff(InputArray, InputHLen, InputVLen,3);
+    Mydiff(InputArray, InputHLen, InputVLen,3,Scratch);
     MinArray(InputArray, InputHLen, InputVLen, MinT);
    
     for (i=0;i<InputVLen;i++)
@@ -1249,10 +1896,10 @@ void Edetect(double *InputArray, int InputHLen, int InputVLen, double MinT, doub
     }
     
     MeanV(InputArray,InputHLen,InputVLen,OutOne);
-    Smooth(OutOne, InputHLen,3);
-    Smooth(OutOne, InputHLen,3);
-    Move(OutOne,InputHLen,-2);
-    PeakDetect(OutOne,InputHLen);
+    Smooth(OutOne, InputHLen,3,Scratch);
+    Smooth(OutOne, InputHLen,3,Scratch);
+    Move(OutOne,InputHLen,-2,Scratch);
+    PeakDetect(OutOne,InputHLen,Scratch);
     MinArray(OutOne, InputHLen,1, db1);
     
     for (j=0;j<InputHLen;j++)
@@ -1264,15 +1911,17 @@ void Edetect(double *InputArray, int InputHLen, int InputVLen, double MinT, doub
 
 
 
-void OnsetDetection2(double *In,int InputLen,double *OutOne,double a,double b)
+template <typename T>
+void OnsetDetection2(const T *In,int InputLen,double *OutOne,double a,double b,TranscriptionScratch *Scratch)
 {
     int mseconds;
     double *Input;
+    size_t ScratchMark=Scratch->mark();
     
 
     mseconds=InputLen;
 
-    Input=(double *)malloc(mseconds*960*sizeof(double));
+    Input=Scratch->allocate(mseconds*960);
      
     ConFrom1050To960(In,Input,InputLen);
 
@@ -1281,38 +1930,38 @@ void OnsetDetection2(double *In,int InputLen,double *OutOne,double a,double b)
 
     if(a>0)
     {
-        Edetect(Input,mseconds,960, a,b,OutOne);
+        Edetect(Input,mseconds,960, a,b,OutOne,Scratch);
     }
 
 
-    free(Input);   
+    Scratch->release(ScratchMark);
 
 }
 
-void PitchEstimation(double *In, int /* InLen */, double *OutArray,double *OutArray2)
+void PitchEstimation(double *In, int /* InLen */, double *OutArray,double *OutArray2,TranscriptionScratch *Scratch)
 {
-    double *xx,*x,*y,*y1,*PeakPitch1, *PeakPitch2,*PeakInput1, *PeakInput2;
+    double *x,*y,*y1,*PeakPitch1, *PeakPitch2,*PeakInput1, *PeakInput2;
     double *out,*outValue;
     double *output,*output1;
     int *outc;
     double temp;
     int i,sumI;
     int Len;
+    size_t ScratchMark=Scratch->mark();
  
     Len=1050;
-    xx=(double*)malloc(Len*sizeof(double));
-    x=(double*)malloc(Len*sizeof(double));
-    y=(double*)malloc(Len*sizeof(double));
-    y1=(double*)malloc(Len*sizeof(double));
-    PeakPitch1=(double*)malloc(Len*sizeof(double));
-    PeakPitch2=(double*)malloc(Len*sizeof(double));
-    PeakInput1=(double*)malloc(Len*sizeof(double));
-    PeakInput2=(double*)malloc(Len*sizeof(double));
-    out=(double*)malloc(Len*sizeof(double));
-    outValue=(double*)malloc(Len*sizeof(double));
-    output=(double*)malloc(112*sizeof(double));
-    output1=(double*)malloc(112*sizeof(double));
-    outc=(int*)malloc(112*sizeof(int)); 
+    x=Scratch->allocate(Len);
+    y=Scratch->allocate(Len);
+    y1=Scratch->allocate(Len);
+    PeakPitch1=Scratch->allocate(Len);
+    PeakPitch2=Scratch->allocate(Len);
+    PeakInput1=Scratch->allocate(Len);
+    PeakInput2=Scratch->allocate(Len);
+    out=Scratch->allocate(Len);
+    outValue=Scratch->allocate(Len);
+    output=Scratch->allocate(112);
+    output1=Scratch->allocate(112);
+    outc=(int*)Scratch->allocate(112); 
 // yI=(double*)malloc(12*sizeof(double));
  
  
@@ -1326,14 +1975,14 @@ void PitchEstimation(double *In, int /* InLen */, double *OutArray,double *OutAr
         y1[i]=x[i];   
     }
 
-    ConToPitch1250(y1,Len);
+    ConToPitch1250(y1,Len,Scratch);
 
     for (i=0;i<Len;i++)
     {
         y[i]=y1[i];   
     }
 
-    Smooth(y,Len,30);
+    Smooth(y,Len,30,Scratch);
 
     for (i=0;i<Len;i++)
     {  
@@ -1378,7 +2027,7 @@ void PitchEstimation(double *In, int /* InLen */, double *OutArray,double *OutAr
 
     if (sumI>12)
     {
-        FindMaxN(PeakPitch1,Len,12);
+        FindMaxN(PeakPitch1,Len,12,Scratch);
     
         for (i=0;i<Len;i++)
         {
@@ -1464,67 +2113,46 @@ void PitchEstimation(double *In, int /* InLen */, double *OutArray,double *OutAr
         } 
     }
 
-    free(xx); // xx=(double*)malloc(Len*sizeof(double));
-    free(x); // x=(double*)malloc(Len*sizeof(double));
-    free(y); // y=(double*)malloc(Len*sizeof(double));
-    free(y1);  // y1=(double*)malloc(Len*sizeof(double));
-    free(PeakPitch1); //=(double*)malloc(Len*sizeof(double));
-    free(PeakPitch2); //=(double*)malloc(Len*sizeof(double));
-    free(PeakInput1); //=(double*)malloc(Len*sizeof(double));
-    free(PeakInput2); //=(double*)malloc(Len*sizeof(double));
-    free(out); //=(double*)malloc(Len*sizeof(double));
-    free(outValue); //=(double*)malloc(Len*sizeof(double));
-    free(output); //=(double*)malloc(112*sizeof(double));
-    free(output1); //=(double*)malloc(112*sizeof(double));
-    free(outc); //=(double*)malloc(112*sizeof(int)); 
-//free(yI); //=(double*)malloc(12*sizeof(int));
+    Scratch->release(ScratchMark);
 //  printf(" end free \n");
 }
 
-void DoMultiPitch(double *In, int RLen,int CLen, double *Out1, double *Out2)
+// Frames of DoMultiPitch are independent once the mean level of each
+// has been found relative to the loudest, so they may be estimated in
+// ranges.
+
+template <typename T>
+struct MultiPitchJobData
 {
-  
+    const T *In;
+    int RLen;
+    double *mean1;
+    T *Out1;
+    T *Out2;
+};
+
+template <typename T>
+void MultiPitchJob(void *Data, int From, int To, TranscriptionScratch *Scratch)
+{
+    MultiPitchJobData<T> *d=(MultiPitchJobData<T> *)Data;
+    const T *In=d->In;
+    int RLen=d->RLen;
+    double *mean1=d->mean1;
+    T *Out1=d->Out1;
+    T *Out2=d->Out2;
     int i, j;
-    double *sum1,*mean1;
     double MaxV;
     double *OutArray1, *OutArray2,*tempArray;
+    size_t ScratchMark=Scratch->mark();
  
-    OutArray1=(double *)malloc(112*sizeof(double));
-    OutArray2=(double *)malloc(112*sizeof(double));
-    tempArray=(double *)malloc(RLen*sizeof(double));
- 
-    sum1=(double*)malloc(CLen*sizeof(double));
-    mean1=(double*)malloc(CLen*sizeof(double));
- 
-    for (j=0;j<CLen;j++)
+    OutArray1=Scratch->allocate(112);
+    OutArray2=Scratch->allocate(112);
+    tempArray=Scratch->allocate(RLen);
+  
+    for (j=From;j<To;j++)
     {
-        sum1[j]=0;
-        for (i=0;i<RLen;i++)
-        {
-            sum1[j]=sum1[j]+In[j*RLen+i];
-        }  
-     
-        mean1[j]=sum1[j]/CLen;
-    }
-    MaxV=mean1[0];
-    for (j=0;j<CLen;j++)
-    {
-        if(mean1[j]>MaxV)
-        {
-            MaxV=mean1[j];
-        }
-    }
-   
-    for (j=0;j<CLen;j++)
-    {   
-        mean1[j]=mean1[j]-MaxV;
-    }  
- 
-  
-    for (j=0;j<CLen;j++)
-    {
-      
-        for (i=0;i<112;i++)
+      
+        for (i=0;i<112;i++)
         {
         
             OutArray1[i]=0;
@@ -1542,7 +2170,7 @@ void DoMultiPitch(double *In, int RLen,int CLen, double *Out1, double *Out2)
         if(mean1[j]>-55)
         {
      
-            PitchEstimation(tempArray,RLen,OutArray1,OutArray2);  
+            PitchEstimation(tempArray,RLen,OutArray1,OutArray2,Scratch);  
      
             for(i=0;i<112;i++)
             {
@@ -1569,11 +2197,55 @@ void DoMultiPitch(double *In, int RLen,int CLen, double *Out1, double *Out2)
     
     }  
 
-    free(OutArray1);
-    free(OutArray2);
-    free(tempArray);
-    free(sum1);
-    free(mean1);
+    Scratch->release(ScratchMark);
+}
+
+template <typename T>
+void DoMultiPitch(const T *In, int RLen,int CLen, T *Out1, T *Out2,TranscriptionPool *Pool,TranscriptionScratch *Scratch)
+{
+  
+    int i, j;
+    double *sum1,*mean1;
+    double MaxV;
+    MultiPitchJobData<T> d;
+    size_t ScratchMark=Scratch->mark();
+ 
+    sum1=Scratch->allocate(CLen);
+    mean1=Scratch->allocate(CLen);
+ 
+    for (j=0;j<CLen;j++)
+    {
+        sum1[j]=0;
+        for (i=0;i<RLen;i++)
+        {
+            sum1[j]=sum1[j]+In[j*RLen+i];
+        }  
+     
+        mean1[j]=sum1[j]/CLen;
+    }
+    MaxV=mean1[0];
+    for (j=0;j<CLen;j++)
+    {
+        if(mean1[j]>MaxV)
+        {
+            MaxV=mean1[j];
+        }
+    }
+   
+    for (j=0;j<CLen;j++)
+    {   
+        mean1[j]=mean1[j]-MaxV;
+    }  
+
+    d.In=In;
+    d.RLen=RLen;
+    d.mean1=mean1;
+    d.Out1=Out1;
+    d.Out2=Out2;
+
+    RunJob(Pool,MultiPitchJob<T>,&d,0,CLen,Scratch);
+
+    Scratch->release(ScratchMark);
 }
 
 
@@ -1602,7 +2274,8 @@ int OnsetToArray(double *In, int Len, double *OutStart,double *OutEnd)
     return count;
    
 }
-void dbfunction( double *InputArray, int InputHLen, int InputVLen,double *OutArray)
+template <typename S, typename T>
+void dbfunction( const S *InputArray, int InputHLen, int InputVLen,T *OutArray)
 {
     int i;
     int j;
@@ -1611,121 +2284,159 @@ void dbfunction( double *InputArray, int InputHLen, int InputVLen,double *OutArr
     {
         for (j=0;j<InputHLen;j++)
         {
-            OutArray[i*InputHLen+j]=20*log10(InputArray[i*InputHLen+j]);
+            OutArray[i*InputHLen+j]=20*log10((double)InputArray[i*InputHLen+j]);
             
         }
               
     }
 }    
 
-void Transcribe(int Len,int inputLen,double *SoundIn,double *out,double *outArray2,double *outArray3,double SampleRate)
+// Interpolate one frame of 210 resonator levels (half-semitone
+// spacing) to 1050 values (tenth-semitone spacing).
+
+template <typename S, typename T>
+void ConFrom210To1050(const S *In, T *Out)
 {
-    int OnsetN;
-    int i,j,k;
-    int count;
-    int index;
-    double *OutStart,*OutEnd;
-    int start,endd,startb=1,start2,endd2;
-    double *A1,*A2,*A3,*A4,*A5,*A6,*D,*D2;
-    double *A6A;
-    double *out2, *PitchOut1,*PitchOut2,*PitchOut3;
-    double sum,maxV,maxVal;
-    double *tempArray;
-    double temp;
-    double p;
-    double M1,M2;
-    double *In;
-    int Len2;
-    double *dbs,*ss,*dbs1,*jj;
-    int TempInt;
-  
-    
-    A1=(double *)malloc(112*sizeof(double));
-    A2=(double *)malloc(112*sizeof(double));
-    A3=(double *)malloc(112*sizeof(double));
-    A4=(double *)malloc(112*sizeof(double));
-    A5=(double *)malloc(112*sizeof(double));
-    A6=(double *)malloc(112*sizeof(double));
-    D=(double *)malloc(112*sizeof(double));
-    D2=(double *)malloc(112*sizeof(double));
-    PitchOut1=(double *)malloc(112*Len*sizeof(double));
-    PitchOut2=(double *)malloc(112*Len*sizeof(double));
-    PitchOut3=(double *)malloc(112*Len*sizeof(double));
-    OutStart=(double *)malloc(Len*sizeof(double));
-    OutEnd=(double *)malloc(Len*sizeof(double));
-    tempArray=(double *)malloc(sizeof(double)*Len);
-    In=(double *)malloc(sizeof(double)*Len);
-    dbs=(double *)malloc(1050*sizeof(double)*Len);
-    dbs1=(double *)malloc(210*sizeof(double)*Len);
-    ss=(double *)malloc(210*sizeof(double)*Len);
-    jj=(double *)malloc(1050*sizeof(double));
-    
-    
-    
-    
-    for(k=0;k<1050;k++)
+    int k,TempInt;
+    double jj;
+
+    for(k=0;k<1045;k++)
     {
-        
-        jj[k]=k/5.0; 
-        
+        jj=k/5.0;
+        TempInt=(int)jj;
+        Out[k]=(jj-TempInt)*In[TempInt+1]+(TempInt+1-jj)*In[TempInt];   
     }
-    
-    sofacomplexMex(SoundIn,ss,inputLen,20,0.5,210,0.03,20,SampleRate);
-    dbfunction(ss, Len, 210,dbs1);
-   
-    for(i=0;i<Len;i++)
-    {
-        for(k=0;k<1045;k++)
-        {
-            TempInt=(int)jj[k];
-            dbs[k+i*1050]=(jj[k]-TempInt)*dbs1[TempInt+1+i*210]+(TempInt+1-jj[k])*dbs1[TempInt+i*210];   
-         
-        }
-     
-        for (k=1045;k<1050;k++)
-        {
-            dbs[k+i*1050]=dbs[1044+i*1050];  
-        }
      
-    }
-      
-    OnsetDetection2(dbs,Len,In,3,1.2);
-    for (i=0;i<Len;i++)
-    {
-        outArray2[i]=In[i]; 
-         
-    }
-    
-    OnsetN=0;
-    count=0;
-    for (i=0;i<Len;i++)
+    for (k=1045;k<1050;k++)
     {
-        if(In[i]>0)
-        {
-            OnsetN=OnsetN+1;
-            count=count+1;
-        }
+        Out[k]=Out[1044];  
     }
-    Len2=count;
-    out2=(double *)malloc(112*Len2*sizeof(double));
-    A6A=(double *)malloc(112*Len2*sizeof(double));
-    OnsetToArray(In,Len,OutStart,OutEnd); 
-    DoMultiPitch(dbs,1050,Len, PitchOut1, PitchOut2);
+}
 
-    
-    for (i=0;i<Len;i++)
+// The front end of Transcribe: the resonator bank, which may be run
+// in bands of notes, and the conversion of its output to dB and
+// interpolation, which may be run in ranges of frames.
+
+template <typename T>
+struct ResonatorJobData
+{
+    double *SoundIn;
+    int inputLen;
+    double SampleRate;
+    T *ss;
+    T *dbs1;
+    T *dbs;
+};
+
+template <typename T>
+void ResonatorBandJob(void *Data, int From, int To, TranscriptionScratch *)
+{
+    ResonatorJobData<T> *d=(ResonatorJobData<T> *)Data;
+    int mseconds;
+
+    ResonatorBank bank(20,0.5,210,0.03,20,d->SampleRate,From,To);
+
+    mseconds=(int)(100*d->inputLen/d->SampleRate);
+    bank.process(d->SoundIn, mseconds*bank.getHop(), d->ss);
+}
+
+template <typename T>
+void LevelFramesJob(void *Data, int From, int To, TranscriptionScratch *)
+{
+    ResonatorJobData<T> *d=(ResonatorJobData<T> *)Data;
+    int i;
+
+    dbfunction(d->ss+From*210, To-From, 210, d->dbs1+From*210);
+   
+    for(i=From;i<To;i++)
     {
-        for (j=0;j<112;j++)
-        {  
-            PitchOut3[i*112+j]=PitchOut1[i*112+j];
-            if(PitchOut3[i*112+j]>1)
-                PitchOut3[i*112+j]=1;
-        }
-        
+        ConFrom210To1050(d->dbs1+i*210,d->dbs+i*1050);
     }
+}
+
+template <typename T>
+void Transcribe(int Len,int inputLen,double *SoundIn,double *out,double *outArray2,double *outArray3,double SampleRate,TranscriptionPool *Pool,TranscriptionScratch *Scratch)
+{
+    T *dbs,*ss,*dbs1;
+    ResonatorJobData<T> d;
+    size_t ScratchMark=Scratch->mark();
+    size_t FramesMark;
+
+    dbs=Scratch->allocateArray<T>(1050*Len);
+    FramesMark=Scratch->mark();
+    dbs1=Scratch->allocateArray<T>(210*Len);
+    ss=Scratch->allocateArray<T>(210*Len);
+
+    d.SoundIn=SoundIn;
+    d.inputLen=inputLen;
+    d.SampleRate=SampleRate;
+    d.ss=ss;
+    d.dbs1=dbs1;
+    d.dbs=dbs;
     
+    RunJob(Pool,ResonatorBandJob<T>,&d,0,210,Scratch);
+    RunJob(Pool,LevelFramesJob<T>,&d,0,Len,Scratch);
 
-    for (i=0;i<OnsetN;i++)
+    Scratch->release(FramesMark);
+
+    TranscribeFrames(Len,dbs,out,outArray2,outArray3,0,Pool,Scratch);
+
+    Scratch->release(ScratchMark);
+}
+
+// Note decisions for each onset segment of TranscribeFrames.  The
+// first pass depends only on the pitch estimates, and the second
+// (which removes notes repeated from the previous segment) only on
+// the first pass, so each may be run in ranges of segments.
+
+template <typename T>
+struct OnsetJobData
+{
+    int Len;
+    int OnsetN;
+    const T *dbs;
+    double *OutStart;
+    double *OutEnd;
+    T *PitchOut1;
+    T *PitchOut2;
+    T *PitchOut3;
+    double *A6A;
+    double *out;
+    double *out2;
+};
+
+template <typename T>
+void OnsetNotesJob(void *Data, int From, int To, TranscriptionScratch *Scratch)
+{
+    OnsetJobData<T> *d=(OnsetJobData<T> *)Data;
+    double *OutStart=d->OutStart;
+    double *OutEnd=d->OutEnd;
+    T *PitchOut1=d->PitchOut1;
+    T *PitchOut2=d->PitchOut2;
+    T *PitchOut3=d->PitchOut3;
+    double *A6A=d->A6A;
+    double *out=d->out;
+    double *out2=d->out2;
+    int i,j,k;
+    int count;
+    int start,endd,startb=1;
+    double *A1,*A2,*A3,*A4,*A5,*A6,*D,*D2;
+    double sum,maxV,maxVal;
+    double *tempArray;
+    double temp;
+    size_t ScratchMark=Scratch->mark();
+
+    A1=Scratch->allocate(112);
+    A2=Scratch->allocate(112);
+    A3=Scratch->allocate(112);
+    A4=Scratch->allocate(112);
+    A5=Scratch->allocate(112);
+    A6=Scratch->allocate(112);
+    D=Scratch->allocate(112);
+    D2=Scratch->allocate(112);
+    tempArray=Scratch->allocate(d->Len);
+
+    for (i=From;i<To;i++)
     {  
         for(j=0;j<112;j++)
         {
@@ -1946,8 +2657,35 @@ void Transcribe(int Len,int inputLen,double *SoundIn,double *out,double *outArra
             out2[j+i*112]=D[j];
         }   
     }
-   
-    for (i=1;i<OnsetN;i++)
+
+    Scratch->release(ScratchMark);
+}
+
+template <typename T>
+void OnsetRepeatsJob(void *Data, int From, int To, TranscriptionScratch *Scratch)
+{
+    OnsetJobData<T> *d=(OnsetJobData<T> *)Data;
+    int OnsetN=d->OnsetN;
+    const T *dbs=d->dbs;
+    double *OutStart=d->OutStart;
+    double *OutEnd=d->OutEnd;
+    T *PitchOut1=d->PitchOut1;
+    T *PitchOut3=d->PitchOut3;
+    double *out=d->out;
+    double *out2=d->out2;
+    int i,j,k;
+    int count;
+    int index;
+    int start2,endd2;
+    double *A1;
+    double sum;
+    double p;
+    double M1,M2;
+    size_t ScratchMark=Scratch->mark();
+
+    A1=Scratch->allocate(112);
+
+    for (i=From;i<To;i++)
     {
         start2=(int)OutStart[i];
         endd2=(int)OutEnd[i];
@@ -2007,24 +2745,106 @@ void Transcribe(int Len,int inputLen,double *SoundIn,double *out,double *outArra
             }
         }
     }
+
+    Scratch->release(ScratchMark);
+}
+
+// Estimate notes from Len frames of interpolated resonator levels in
+// dB, 1050 values per frame.  Note times written to outArray3 are
+// offset by FrameOffset frames, so that a window taken from a longer
+// input reports times from the start of that input.
+
+template <typename T>
+void TranscribeFrames(int Len,T *dbs,double *out,double *outArray2,double *outArray3,int FrameOffset,TranscriptionPool *Pool,TranscriptionScratch *Scratch)
+{
+    int OnsetN;
+    int i,j,k;
+    int count;
+    double *OutStart,*OutEnd;
+    int start;
+    double *A6A;
+    double *out2;
+    T *PitchOut1,*PitchOut2,*PitchOut3;
+    double *In;
+    int Len2;
+    OnsetJobData<T> d;
+    size_t ScratchMark=Scratch->mark();
+  
     
+    PitchOut1=Scratch->allocateArray<T>(112*Len);
+    PitchOut2=Scratch->allocateArray<T>(112*Len);
+    PitchOut3=Scratch->allocateArray<T>(112*Len);
+    OutStart=Scratch->allocate(Len);
+    OutEnd=Scratch->allocate(Len);
+    In=Scratch->allocate(Len);
+      
+    OnsetDetection2(dbs,Len,In,3,1.2,Scratch);
+    for (i=0;i<Len;i++)
+    {
+        outArray2[i]=In[i]; 
+         
+    }
+    
+    OnsetN=0;
+    count=0;
+    for (i=0;i<Len;i++)
+    {
+        if(In[i]>0)
+        {
+            OnsetN=OnsetN+1;
+            count=count+1;
+        }
+    }
+    Len2=count;
+    out2=Scratch->allocate(112*Len2);
+    A6A=Scratch->allocate(112*Len2);
+    OnsetToArray(In,Len,OutStart,OutEnd); 
+    DoMultiPitch(dbs,1050,Len, PitchOut1, PitchOut2,Pool,Scratch);
+
+    
+    for (i=0;i<Len;i++)
+    {
+        for (j=0;j<112;j++)
+        {  
+            PitchOut3[i*112+j]=PitchOut1[i*112+j];
+            if(PitchOut3[i*112+j]>1)
+                PitchOut3[i*112+j]=1;
+        }
+        
+    }
+    
+
+    d.Len=Len;
+    d.OnsetN=OnsetN;
+    d.dbs=dbs;
+    d.OutStart=OutStart;
+    d.OutEnd=OutEnd;
+    d.PitchOut1=PitchOut1;
+    d.PitchOut2=PitchOut2;
+    d.PitchOut3=PitchOut3;
+    d.A6A=A6A;
+    d.out=out;
+    d.out2=out2;
+
+    RunJob(Pool,OnsetNotesJob<T>,&d,0,OnsetN,Scratch);
+    RunJob(Pool,OnsetRepeatsJob<T>,&d,1,OnsetN,Scratch);
+
     count=0;
     for (i=0;i<OnsetN;i++)
     {  
         
         start=(int)OutStart[i];
-        endd=(int)OutEnd[i];
         
         for(j=0;j<112;j++)
         {
             if(out[j+i*112]>0)
             {
                 outArray3[count*3+0]=j+1-21;//exp((log(2.0))*(j+1-69)/12)*440;
-                outArray3[count*3+1]=start*0.01;
+                outArray3[count*3+1]=(FrameOffset+start)*0.01;
             
                 if(i==(OnsetN-1))
                 {
-                    outArray3[count*3+2]=0.01*OutEnd[i];
+                    outArray3[count*3+2]=0.01*(FrameOffset+OutEnd[i]);
                 }  
                 else
                 {
@@ -2034,18 +2854,18 @@ void Transcribe(int Len,int inputLen,double *SoundIn,double *out,double *outArra
                 
                         if(k==(OnsetN-1))
                         {
-                            outArray3[count*3+2]=0.01*OutEnd[k];
+                            outArray3[count*3+2]=0.01*(FrameOffset+OutEnd[k]);
                         }  
 				   
                         if(out[j+k*112]>0)
                         {
-                            outArray3[count*3+2]=0.01*OutStart[k];
+                            outArray3[count*3+2]=0.01*(FrameOffset+OutStart[k]);
                             break;  
                         }
                  
                         if(A6A[k*112+j]<0.5)
                         {
-                            outArray3[count*3+2]=0.01*OutStart[k];
+                            outArray3[count*3+2]=0.01*(FrameOffset+OutStart[k]);
                             break;   
                      
                         }
@@ -2064,26 +2884,181 @@ void Transcribe(int Len,int inputLen,double *SoundIn,double *out,double *outArra
     outArray3[count*3+1]=0;
     outArray3[count*3+2]=0;
        
-    free(tempArray);
-    free(OutStart);
-    free(OutEnd);
-    free(A1);
-    free(A2);
-    free(A3);
-    free(A4);
-    free(A5);
-    free(A6);
-    free(A6A);
-    free(D);
-    free(D2);
-    free(out2);
-    free(PitchOut1);
-    free(PitchOut2);
-    free(PitchOut3);
-    free(In);
-    free(dbs);
-    free(dbs1);
-    free(ss);
-    free(jj);
+    Scratch->release(ScratchMark);
+}
+
+// Upper bounds on the scratch space, in doubles, used on the calling
+// thread by Transcribe and TranscribeFrames for Len frames, with
+// resonator levels and pitch estimates of ValueSize bytes each, and
+// by each worker thread for any job they run.  The largest demands
+// are made during onset detection, which needs two 960-value copies
+// of each frame alongside the pitch and onset arrays.
+
+static size_t ScratchDoubles(size_t n,size_t ValueSize)
+{
+    return (n*ValueSize+sizeof(double)-1)/sizeof(double);
+}
+
+size_t TranscribeFramesScratchSize(int Len,size_t ValueSize)
+{
+    return 3*ScratchDoubles((size_t)Len*112,ValueSize) + (size_t)Len*(3+2*960+3) + TranscriptionJobScratchSize(Len);
+}
+
+size_t TranscribeScratchSize(int Len,size_t ValueSize)
+{
+    return ScratchDoubles((size_t)Len*1050,ValueSize) + TranscribeFramesScratchSize(Len,ValueSize);
+}
+
+size_t TranscriptionJobScratchSize(int Len)
+{
+    return (size_t)Len + 16*1050;
+}
+
+TranscriptionStream::TranscriptionStream(double SampleRate, int BlockSize,
+                                         bool Single,
+                                         TranscriptionPool *Pool,
+                                         TranscriptionScratch *Scratch) :
+    m_pool(Pool),
+    m_scratch(Scratch),
+    m_blockSize(BlockSize),
+    m_single(Single),
+    m_dbs(0),
+    m_dbsSingle(0),
+    m_frames(0),
+    m_base(0),
+    m_scanned(0)
+{
+    int i;
+
+    m_bank=new ResonatorBank(20,0.5,210,0.03,20,SampleRate);
+
+    m_input=(double *)malloc(m_blockSize*sizeof(double));
+    m_levels=(double *)malloc(210*(m_blockSize/m_bank->getHop()+1)*sizeof(double));
+    m_levelsdb=(double *)malloc(210*sizeof(double));
+    if (m_single) {
+        m_dbsSingle=(float *)malloc(1050*StreamWindow*sizeof(float));
+    } else {
+        m_dbs=(double *)malloc(1050*StreamWindow*sizeof(double));
+    }
+    m_out=(double *)malloc(112*StreamWindow*sizeof(double));
+    m_out2=(double *)malloc(StreamWindow*sizeof(double));
+    m_notes=(double *)malloc(3*3000*sizeof(double));
+    m_roll=(double *)malloc(88*StreamWindow*sizeof(double));
+
+    for (i=0;i<88*StreamWindow;i++)
+    {
+        m_roll[i]=0;
+    }
+    for (i=0;i<88;i++)
+    {
+        m_starts[i]=-1.0;
+    }
 }
 
+TranscriptionStream::~TranscriptionStream()
+{
+    delete m_bank;
+    free(m_input);
+    free(m_levels);
+    free(m_levelsdb);
+    free(m_dbs);
+    free(m_dbsSingle);
+    free(m_out);
+    free(m_out2);
+    free(m_notes);
+    free(m_roll);
+}
+
+void
+TranscriptionStream::process(const float *Input, Vamp::RealTime Base,
+                             Vamp::Plugin::FeatureList &Features)
+{
+    int i,rows;
+
+    for (i=0;i<m_blockSize;i++)
+    {
+        m_input[i]=Input[i];
+    }
+
+    rows=m_bank->process(m_input,m_blockSize,m_levels);
+
+    for (i=0;i<rows;i++)
+    {
+        dbfunction(m_levels+i*210,210,1,m_levelsdb);
+        if (m_single)
+        {
+            ConFrom210To1050(m_levelsdb,m_dbsSingle+m_frames*1050);
+        }
+        else
+        {
+            ConFrom210To1050(m_levelsdb,m_dbs+m_frames*1050);
+        }
+        m_frames=m_frames+1;
+
+        if (m_frames==StreamWindow)
+        {
+            analyse(StreamWindow,
+                    m_base==0 ? 0 : m_base+StreamContext,
+                    m_base+StreamContext+StreamHop);
+
+            ScanNotes(m_roll,StreamWindow,m_scanned,m_base+StreamContext+StreamHop,
+                      m_starts,Base,Features);
+            m_scanned=m_base+StreamContext+StreamHop;
+
+            if (m_single)
+            {
+                memmove(m_dbsSingle,m_dbsSingle+StreamHop*1050,
+                        (StreamWindow-StreamHop)*1050*sizeof(float));
+            }
+            else
+            {
+                memmove(m_dbs,m_dbs+StreamHop*1050,
+                        (StreamWindow-StreamHop)*1050*sizeof(double));
+            }
+            m_frames=StreamWindow-StreamHop;
+            m_base=m_base+StreamHop;
+        }
+    }
+}
+
+void
+TranscriptionStream::finish(int TotalFrames, Vamp::RealTime Base,
+                            Vamp::Plugin::FeatureList &Features)
+{
+    int Len;
+
+    // The input may end part way through a frame, or (at sample rates
+    // that are not a multiple of 100) the resonator bank may have
+    // produced more frames than the input duration accounts for;
+    // either way TotalFrames is the number the batch analysis uses.
+    // Anything before m_scanned has already been reported.
+
+    Len=TotalFrames-m_base;
+    if (Len>m_frames) Len=m_frames;
+
+    if (m_base+Len>m_scanned)
+    {
+        analyse(Len,
+                m_base==0 ? 0 : m_base+StreamContext,
+                m_base+Len);
+        ScanNotes(m_roll,StreamWindow,m_scanned,m_base+Len,
+                  m_starts,Base,Features);
+        m_scanned=m_base+Len;
+    }
+
+    CloseNotes(m_scanned,m_starts,Base,Features);
+}
+
+void
+TranscriptionStream::analyse(int Len, int AcceptFrom, int AcceptTo)
+{
+    if (m_single)
+    {
+        TranscribeFrames(Len,m_dbsSingle,m_out,m_out2,m_notes,m_base,m_pool,m_scratch);
+    }
+    else
+    {
+        TranscribeFrames(Len,m_dbs,m_out,m_out2,m_notes,m_base,m_pool,m_scratch);
+    }
+    RenderNotes(m_notes,m_roll,StreamWindow,AcceptFrom,AcceptTo);
+}
@@ -5,6 +5,10 @@
 
 #include <vamp-sdk/Plugin.h>
 
+class TranscriptionStream;
+class TranscriptionPool;
+class TranscriptionScratch;
+
 class Transcription : public Vamp::Plugin
 {
 public:
@@ -25,6 +29,10 @@ public:
 	  size_t getPreferredStepSize() const;
     size_t getPreferredBlockSize() const;
 
+    ParameterList getParameterDescriptors() const;
+    float getParameter(std::string) const;
+    void setParameter(std::string, float);
+
     OutputList getOutputDescriptors() const;
 
     FeatureSet process(const float *const *inputBuffers,
@@ -40,6 +48,12 @@ protected:
     int m_AllocN;
     bool m_Excess;
     Vamp::RealTime m_Base;
+    bool m_streaming;
+    TranscriptionStream *m_stream;
+    int m_threads;
+    TranscriptionPool *m_pool;
+    TranscriptionScratch *m_scratch;
+    bool m_single;
 /*
  void sofacomplexMex(double *y, double *z, int ncols,double StartNote,double NoteInterval1,double NoteNum,double C,double D);
  void FindMaxN( double *InputArray, int InputLen,int MaxOrder);
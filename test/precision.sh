@@ -0,0 +1,128 @@
+#!/bin/bash
+
+# Compare the notes returned by the Polyphonic Transcription plugin
+# using single-precision intermediate arrays against those returned
+# using double precision (the default), on the same test file as
+# regression.sh. The two are not expected to be identical, but almost
+# all notes should agree in pitch and onset.
+
+set -eu
+
+mydir=$(dirname "$0")
+
+source_url=https://code.soundsoftware.ac.uk/attachments/download/1698/Zweieck-Duell.ogg
+
+testfile="$mydir/tmp/input.ogg"
+
+# Minimum acceptable percentage of notes found in both outputs
+threshold=98
+
+# Maximum difference in onset time, in seconds, for two notes of the
+# same pitch to be considered the same note
+tolerance=0.02
+
+mkdir -p "$mydir/tmp"
+
+if sonic-annotator -v >/dev/null ; then
+    :
+else
+    echo "Failed to find required binary sonic-annotator"
+    exit 1
+fi
+
+if [ ! -f "$testfile" ]; then
+    if wget --version >/dev/null ; then
+        wget -O "$testfile" "$source_url"
+    else
+        curl -o "$testfile" "$source_url"
+    fi
+fi
+
+mkdir -p "$mydir/precision-obtained"
+
+for precision in 0 1 ; do
+
+    transform="$mydir/tmp/transcription-$precision.n3"
+    outfile="$mydir/precision-obtained/transcription-$precision.csv"
+
+    cat > "$transform" <<EOF
+@prefix xsd: <http://www.w3.org/2001/XMLSchema#> .
+@prefix vamp: <http://purl.org/ontology/vamp/> .
+@prefix : <#> .
+
+:transform a vamp:Transform ;
+    vamp:plugin <http://vamp-plugins.org/rdf/plugins/qm-vamp-plugins#qm-transcription> ;
+    vamp:output [ vamp:identifier "transcription" ] ;
+    vamp:parameter_binding [
+        vamp:parameter [ vamp:identifier "precision" ] ;
+        vamp:value "$precision"^^xsd:float ;
+    ] .
+EOF
+
+    echo
+    echo "Running transcription with precision parameter $precision"
+
+    VAMP_PATH="$mydir/.." \
+             sonic-annotator \
+             -t "$transform" \
+             -w csv \
+             --csv-omit-filename \
+             --csv-one-file "$outfile" \
+             --csv-force \
+             "$testfile"
+done
+
+double="$mydir/precision-obtained/transcription-0.csv"
+single="$mydir/precision-obtained/transcription-1.csv"
+
+echo
+
+if cmp -s "$double" "$single" ; then
+    echo "Done, single-precision output is identical to double-precision output"
+    exit 0
+fi
+
+# Print the number of notes in the first file, and the number of those
+# having a note of the same pitch in the second file with an onset
+# within the tolerance
+
+compare() {
+    awk -F, -v tolerance="$tolerance" '
+        NR == FNR { time[NR] = $1; pitch[NR] = $3; n = NR; next }
+        {
+            total++;
+            for (i = 1; i <= n; ++i) {
+                d = time[i] - $1;
+                if (d < 0) d = -d;
+                if (pitch[i] == $3 && d <= tolerance) { matched++; break; }
+            }
+        }
+        END { printf "%d %d\n", total, matched }
+    ' "$1" "$2"
+}
+
+result=0
+
+for pair in "$single $double" "$double $single" ; do
+
+    set -- $pair
+    counts=$(compare "$1" "$2")
+    total=${counts% *}
+    matched=${counts#* }
+
+    echo "$matched of $total notes in $(basename "$2") are also found in $(basename "$1")"
+
+    if [ $(($matched * 100)) -lt $(($total * $threshold)) ]; then
+        result=1
+    fi
+done
+
+echo
+
+if [ "$result" = "0" ]; then
+    echo "Done, single-precision output agrees with double-precision output to within $threshold%"
+else
+    echo "ERROR: Single-precision output differs from double-precision output by more than $((100 - $threshold))%"
+fi
+
+exit $result
@@ -0,0 +1,150 @@
+#!/bin/bash
+
+# Compare the beats returned by the Tempo and Beat Tracker plugin
+# when its beat period estimation is divided across several threads
+# against those returned using a single thread (the default). The
+# input is the test file from regression.sh repeated several times,
+# so that it is long enough to be divided into a section per thread.
+# The threaded result is not guaranteed to be identical, but almost
+# all beats should agree.
+
+set -eu
+
+mydir=$(dirname "$0")
+
+source_url=https://code.soundsoftware.ac.uk/attachments/download/1698/Zweieck-Duell.ogg
+
+testfile="$mydir/tmp/input.ogg"
+longfile="$mydir/tmp/long.wav"
+
+# Number of copies of the test file in the long input
+repeats=6
+
+# Thread counts to compare against a single thread
+threadcounts="2 4 8"
+
+# Minimum acceptable percentage of beats found in both outputs
+threshold=99
+
+# Maximum difference in time, in seconds, for two beats to be
+# considered the same beat
+tolerance=0.02
+
+mkdir -p "$mydir/tmp"
+
+for binary in sonic-annotator sox ; do
+    if $binary --version >/dev/null 2>&1 ; then
+        :
+    else
+        echo "Failed to find required binary $binary"
+        exit 1
+    fi
+done
+
+if [ ! -f "$testfile" ]; then
+    if wget --version >/dev/null ; then
+        wget -O "$testfile" "$source_url"
+    else
+        curl -o "$testfile" "$source_url"
+    fi
+fi
+
+if [ ! -f "$longfile" ]; then
+    inputs=""
+    for i in $(seq 1 $repeats) ; do
+        inputs="$inputs $testfile"
+    done
+    sox $inputs "$longfile"
+fi
+
+mkdir -p "$mydir/threads-obtained"
+
+for threads in 1 $threadcounts ; do
+
+    transform="$mydir/tmp/tempotracker-$threads.n3"
+    outfile="$mydir/threads-obtained/beats-$threads.csv"
+
+    cat > "$transform" <<EOF
+@prefix xsd: <http://www.w3.org/2001/XMLSchema#> .
+@prefix vamp: <http://purl.org/ontology/vamp/> .
+@prefix : <#> .
+
+:transform a vamp:Transform ;
+    vamp:plugin <http://vamp-plugins.org/rdf/plugins/qm-vamp-plugins#qm-tempotracker> ;
+    vamp:output [ vamp:identifier "beats" ] ;
+    vamp:parameter_binding [
+        vamp:parameter [ vamp:identifier "threads" ] ;
+        vamp:value "$threads"^^xsd:float ;
+    ] .
+EOF
+
+    echo
+    echo "Running tempo tracker with threads parameter $threads"
+
+    VAMP_PATH="$mydir/.." \
+             sonic-annotator \
+             -t "$transform" \
+             -w csv \
+             --csv-omit-filename \
+             --csv-one-file "$outfile" \
+             --csv-force \
+             "$longfile"
+done
+
+# Print the number of beats in the second file, and the number of
+# those having a beat in the first file within the tolerance
+
+compare() {
+    awk -F, -v tolerance="$tolerance" '
+        NR == FNR { time[NR] = $1; n = NR; next }
+        {
+            total++;
+            for (i = 1; i <= n; ++i) {
+                d = time[i] - $1;
+                if (d < 0) d = -d;
+                if (d <= tolerance) { matched++; break; }
+            }
+        }
+        END { printf "%d %d\n", total, matched }
+    ' "$1" "$2"
+}
+
+single="$mydir/threads-obtained/beats-1.csv"
+
+result=0
+
+echo
+
+for threads in $threadcounts ; do
+
+    threaded="$mydir/threads-obtained/beats-$threads.csv"
+
+    if cmp -s "$single" "$threaded" ; then
+        echo "Output with $threads threads is identical to output with a single thread"
+        continue
+    fi
+
+    for pair in "$single $threaded" "$threaded $single" ; do
+
+        set -- $pair
+        counts=$(compare "$1" "$2")
+        total=${counts% *}
+        matched=${counts#* }
+
+        echo "$matched of $total beats in $(basename "$2") are also found in $(basename "$1")"
+
+        if [ $(($matched * 100)) -lt $(($total * $threshold)) ]; then
+            result=1
+        fi
+    done
+done
+
+echo
+
+if [ "$result" = "0" ]; then
+    echo "Done, threaded output agrees with single-threaded output to within $threshold%"
+else
+    echo "ERROR: Threaded output differs from single-threaded output by more than $((100 - $threshold))%"
+fi
+
+exit $result
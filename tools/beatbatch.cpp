@@ -0,0 +1,310 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    QM Vamp Plugin Set
+
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+    Command-line driver for BeatTrackBatch.  Each input file is either
+    a WAV file (8, 16, 24 or 32-bit PCM or 32-bit float, mixed down to
+    mono) or a text file containing a detection function, one value per
+    line, such as the CSV written by sonic-annotator for the
+    qm-tempotracker detection_fn output (the last comma-separated field
+    of each line is taken).
+
+    For each track one line is written to standard output:
+
+      filename,duration,tempo,elapsed,beat1,beat2,...
+
+    with all times in seconds and the tempo in bpm.  The aggregate
+    throughput is written to standard error at the end.
+*/
+
+#include "plugins/BeatTrackBatch.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <stdint.h>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::cout;
+using std::endl;
+
+static void
+usage(const char *name)
+{
+    cerr << "Usage: " << name << " [-t threads] [-n tracks] [-r rate] [-l listfile] [file ...]\n"
+         << "  -t threads   Number of threads to use (default 4)\n"
+         << "  -n tracks    Number of tracks to load and process at once (default 64)\n"
+         << "  -r rate      Sample rate of all WAV input (default 44100)\n"
+         << "  -l listfile  Read input filenames, one per line, from listfile\n"
+         << "               (\"-\" for standard input) as well as the command line"
+         << endl;
+}
+
+static bool
+endsWith(const string &s, const string &suffix)
+{
+    if (s.length() < suffix.length()) return false;
+    string end = s.substr(s.length() - suffix.length());
+    for (size_t i = 0; i < end.length(); ++i) {
+        if (tolower(end[i]) != suffix[i]) return false;
+    }
+    return true;
+}
+
+static uint32_t
+le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+static uint16_t
+le16(const unsigned char *p)
+{
+    return uint16_t(p[0] | (p[1] << 8));
+}
+
+static bool
+readWav(const string &filename, float rate, vector<float> &audio)
+{
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in) {
+        cerr << "ERROR: Failed to open \"" << filename << "\"" << endl;
+        return false;
+    }
+
+    unsigned char header[12];
+    if (!in.read((char *)header, 12) ||
+        memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4)) {
+        cerr << "ERROR: \"" << filename << "\" is not a WAV file" << endl;
+        return false;
+    }
+
+    int format = 0, channels = 0, bits = 0;
+    uint32_t fileRate = 0;
+
+    unsigned char chunk[8];
+    while (in.read((char *)chunk, 8)) {
+
+        uint32_t size = le32(chunk + 4);
+
+        if (!memcmp(chunk, "fmt ", 4)) {
+
+            vector<unsigned char> fmt(size < 16 ? 16 : size);
+            if (!in.read((char *)&fmt[0], size)) break;
+            format = le16(&fmt[0]);
+            channels = le16(&fmt[2]);
+            fileRate = le32(&fmt[4]);
+            bits = le16(&fmt[14]);
+            if (format == 0xfffe && size >= 26) { // extensible
+                format = le16(&fmt[24]);
+            }
+
+        } else if (!memcmp(chunk, "data", 4)) {
+
+            if (channels < 1 || !(format == 1 || (format == 3 && bits == 32)) ||
+                bits < 8 || bits > 32 || (bits % 8)) {
+                cerr << "ERROR: Unsupported sample format in \""
+                     << filename << "\"" << endl;
+                return false;
+            }
+            if (float(fileRate) != rate) {
+                cerr << "ERROR: Sample rate of \"" << filename << "\" is "
+                     << fileRate << ", expected " << rate << endl;
+                return false;
+            }
+
+            if (size == 0) {
+                audio.clear();
+                return true;
+            }
+
+            int bytes = bits / 8;
+            int frameBytes = bytes * channels;
+            vector<unsigned char> data(size);
+            in.read((char *)&data[0], size);
+            size_t frames = size_t(in.gcount()) / frameBytes;
+
+            audio.resize(frames);
+            for (size_t i = 0; i < frames; ++i) {
+                float sum = 0.f;
+                for (int c = 0; c < channels; ++c) {
+                    const unsigned char *p = &data[i * frameBytes + c * bytes];
+                    float v;
+                    if (format == 3) {
+                        uint32_t u = le32(p);
+                        memcpy(&v, &u, 4);
+                    } else if (bytes == 1) {
+                        v = (int(p[0]) - 128) / 128.f;
+                    } else {
+                        int32_t s = 0;
+                        for (int b = 0; b < bytes; ++b) {
+                            s |= int32_t(p[b]) << (8 * (4 - bytes + b));
+                        }
+                        v = s / 2147483648.f;
+                    }
+                    sum += v;
+                }
+                audio[i] = sum / channels;
+            }
+            return true;
+
+        } else {
+            in.seekg(size + (size & 1), std::ios::cur);
+        }
+    }
+
+    cerr << "ERROR: No audio data found in \"" << filename << "\"" << endl;
+    return false;
+}
+
+static bool
+readDetectionFunction(const string &filename, vector<double> &df)
+{
+    std::ifstream in(filename.c_str());
+    if (!in) {
+        cerr << "ERROR: Failed to open \"" << filename << "\"" << endl;
+        return false;
+    }
+    string line;
+    while (std::getline(in, line)) {
+        size_t comma = line.rfind(',');
+        if (comma != string::npos) line = line.substr(comma + 1);
+        if (line.find_first_not_of(" \t\r") == string::npos) continue;
+        df.push_back(atof(line.c_str()));
+    }
+    return true;
+}
+
+static void
+runBatch(BeatTrackBatch &batch, const vector<string> &names, int threads,
+         BeatTrackBatch::Throughput &total, float rate)
+{
+    vector<BeatTrackBatch::Track> tracks;
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        BeatTrackBatch::Track track;
+        track.name = names[i];
+        bool ok;
+        if (endsWith(names[i], ".wav")) {
+            ok = readWav(names[i], rate, track.audio);
+        } else {
+            ok = readDetectionFunction(names[i], track.df);
+        }
+        if (ok) tracks.push_back(track);
+    }
+
+    BeatTrackBatch::Throughput throughput = batch.process(tracks, threads);
+
+    for (size_t i = 0; i < tracks.size(); ++i) {
+        const BeatTrackBatch::Track &t = tracks[i];
+        char buf[100];
+        sprintf(buf, ",%.3f,%.2f,%.3f", t.duration, t.tempo, t.elapsed);
+        cout << t.name << buf;
+        for (size_t j = 0; j < t.beats.size(); ++j) {
+            sprintf(buf, ",%.6f", t.beats[j]);
+            cout << buf;
+        }
+        cout << "\n";
+    }
+    cout.flush();
+
+    total.tracks += throughput.tracks;
+    total.duration += throughput.duration;
+    total.elapsed += throughput.elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+    int threads = 4;
+    int perBatch = 64;
+    BeatTrackBatch::Parameters params;
+    vector<string> names;
+    vector<string> lists;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-t" || arg == "-n" || arg == "-r" || arg == "-l") {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 2;
+            }
+            string value = argv[++i];
+            if (arg == "-t") threads = atoi(value.c_str());
+            else if (arg == "-n") perBatch = atoi(value.c_str());
+            else if (arg == "-r") params.sampleRate = atof(value.c_str());
+            else lists.push_back(value);
+        } else if (arg == "-h" || arg == "--help") {
+            usage(argv[0]);
+            return 0;
+        } else if (arg.length() > 1 && arg[0] == '-') {
+            usage(argv[0]);
+            return 2;
+        } else {
+            names.push_back(arg);
+        }
+    }
+
+    if (threads < 1) threads = 1;
+    if (perBatch < 1) perBatch = 1;
+
+    for (size_t i = 0; i < lists.size(); ++i) {
+        std::ifstream file;
+        std::istream *in = &std::cin;
+        if (lists[i] != "-") {
+            file.open(lists[i].c_str());
+            if (!file) {
+                cerr << "ERROR: Failed to open list file \""
+                     << lists[i] << "\"" << endl;
+                return 1;
+            }
+            in = &file;
+        }
+        string line;
+        while (std::getline(*in, line)) {
+            if (!line.empty() && line[line.length()-1] == '\r') {
+                line = line.substr(0, line.length()-1);
+            }
+            if (!line.empty()) names.push_back(line);
+        }
+    }
+
+    if (names.empty()) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    BeatTrackBatch batch(params);
+    BeatTrackBatch::Throughput total;
+
+    for (size_t i = 0; i < names.size(); i += perBatch) {
+        size_t end = i + perBatch;
+        if (end > names.size()) end = names.size();
+        vector<string> some(names.begin() + i, names.begin() + end);
+        runBatch(batch, some, threads, total, params.sampleRate);
+    }
+
+    cerr << "Processed " << total.tracks << " of " << names.size()
+         << " tracks (" << total.duration << " seconds of input) in "
+         << total.elapsed << " seconds: "
+         << total.getTracksPerSecond() << " tracks per second, "
+         << total.getRealTimeFactor() << "x real time" << endl;
+
+    return (total.tracks == int(names.size()) ? 0 : 1);
+}